@@ -167,16 +167,23 @@ char* read_cmd(char* prompt, FILE* fp) {
     printf("%s", prompt);
     int c;  // input character
     int pos = 0;  // position of character in cmdline
-    char* cmdline = (char*)malloc(sizeof(char) * MAX_LEN);
+    int size = MAX_LEN;  // bytes allocated for cmdline
+    char* cmdline = (char*)malloc(sizeof(char) * size);
     
     while ((c = getc(fp)) != EOF) {
         if (c == '\n')
             break;
+        if (pos == size - 1) {  // keep room for the terminating '\0'
+            size *= 2;
+            cmdline = (char*)realloc(cmdline, sizeof(char) * size);
+        }
         cmdline[pos++] = c;
     }
     // these two lines are added, in case user presses ctrl+d to exit the shell
-    if (c == EOF && pos == 0)
+    if (c == EOF && pos == 0) {
+        free(cmdline);
         return NULL;
+    }
     cmdline[pos] = '\0';
     return cmdline;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2, splice, tee, F_SETPIPE_SZ, memmem, memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,371 +9,5038 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <errno.h>
+#include <spawn.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
 
 #define MAX_LEN 512
-#define MAXARGS 10
-#define ARGLEN 30
 #define PROMPT "PUCITshell:- "
-#define HIST_SIZE 10
-#define MAX_VARS 100 // Maximum number of variables
+#define PS2 "> " // Prompt for the rest of an unfinished command
+#define HIST_FILE ".pucit_history" // In $HOME unless HISTFILE is set
+#define HIST_ESC '\x1f' // In the history file: ESC n is a newline inside an entry, ESC ESC itself
+#define CMD_HASH_SIZE 256 // Buckets in the command path hash table
+#define LISTING_CACHE_SIZE 16 // Directory listings kept for completion
+#define BUILTIN_SLOTS 64       // Perfect hash table of builtins, see builtin_hash()
+#define BUILTIN_WHOLE_LINE 1   // Runs the rest of its pipeline itself, see run_command()
+#define BUILTIN_PIPE_ONLY 2    // Stands in for the external command only inside a pipeline
+#define ARENA_CHUNK 4096 // Default size of an arena chunk
+#define READ_BUF_SIZE 65536 // Bytes requested from read(2) at a time
+#define SPLICE_CHUNK (1 << 20) // Bytes moved per splice()/tee() call
+#define JOBSTAT_SIZE 64 // Finished commands remembered for jobstat
+#define SOURCE_DEPTH 64 // Nesting limit for source
+#define FD_HIGH 10 // Redirections name descriptors below this; the shell keeps its own above
+
+// Tokens of the command language
+enum { TOK_END, TOK_WORD, TOK_NEWLINE, TOK_PIPE, TOK_AND_IF, TOK_OR_IF, TOK_AMP, TOK_SEMI, TOK_REDIRECT };
+
+// Redirection operators: < > >> n>&m <<; <<- and <<< are kept as REDIR_HEREDOC
+enum { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_HEREDOC, REDIR_HERETABS, REDIR_HERESTRING };
+
+// Kinds of command
+enum { CMD_SIMPLE, CMD_IF, CMD_WHILE, CMD_UNTIL, CMD_FOR };
 
 typedef struct Job {
-    int pid;
-    int job_number;
-    char command[MAX_LEN];
+    int pid;        // Last stage of the pipeline; 0 while the slot is free
+    int job_number; // Stable for the job's lifetime; reused once it ends
+    char *command;
+    long long started; // now_ns() at launch
+    int batch;         // 1 for a task of the running parallel builtin
+    int pgid;          // Process group of all stages, 0 without job control
+    int *pids;         // Every stage of the pipeline
+    int npids;
+    int live;          // Stages not reaped yet
+    int status;        // Wait status of the last stage
+    int stopped;
+    int foreground;
+    struct termios tmodes; // Terminal modes to restore when brought to fg
 } Job;
 
 typedef struct Var {
-    char *name;
-    char *value;
+    char *name;  // Interned; NULL for a slot that was never used
+    char *value; // NULL once the variable is unset
+    unsigned int hash;
     int global; // 1 for global, 0 for local
 } Var;
 
-Job jobs[MAXARGS];
-Var variables[MAX_VARS];
+extern char **environ;
+
+// Bump-pointer allocator: everything for one command line is carved out
+// of its chunks and released at once by arena_reset()
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk *first;
+    ArenaChunk *cur;
+    size_t used;
+} Arena;
+
+// Buffered input: lines are handed out in place from a growable buffer
+// filled by large read(2) calls, so line length is not limited
+typedef struct LineReader {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start; // First byte not yet returned
+    size_t end;   // End of the bytes read so far
+    int eof;
+} LineReader;
+
+// The line being edited at an interactive prompt. Output for a batch of
+// keys is collected in out and goes to the terminal in one write.
+typedef struct LineEditor {
+    const char *prompt; // Of the line being edited: PROMPT or PS2
+    size_t prompt_width;
+    size_t cols;     // Terminal width; longer lines wrap onto more rows
+    char *buf;
+    size_t len;
+    size_t pos;      // Cursor offset in buf, always at a UTF-8 character start
+    size_t cap;
+    long hist;       // History entry shown, 0 for the new line
+    char *draft;     // The new line, kept while browsing history
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    char keys[256];  // Input read but not yet handled
+    size_t key_pos;
+    size_t key_len;
+} LineEditor;
+
+// Per-command latencies collected for -T reports
+typedef struct LatencyStats {
+    long count;
+    long cap;
+    long long *ns;
+} LatencyStats;
+
+// A history line: points into the mmap'ed history file or hist_arena,
+// and is not NUL-terminated
+typedef struct HistEntry {
+    const char *text;
+    size_t len;
+} HistEntry;
+
+// History entries (1-based, ascending) containing one trigram. Lines are
+// indexed with two leading sentinel bytes so prefixes have their own grams.
+typedef struct GramList {
+    unsigned int gram;      // Trigram with bit 24 set; 0 marks an empty slot
+    unsigned int count;
+    unsigned int cap;
+    unsigned int *ids;
+} GramList;
+
+// A builtin command: run in the shell itself, or in a forked child when
+// it is a pipeline stage or runs in the background. Status goes to
+// last_status.
+typedef struct Builtin {
+    const char *name;
+    void (*fn)(char *arglist[]);
+    int flags;
+} Builtin;
+
+// A compiled command line. Nodes live in one arena and are never
+// changed by running them, so a line can be run any number of times;
+// $ expansions are done on each run. Words with an expansion keep the
+// $ and \ that were quoted escaped by a backslash, for expand_word().
+typedef struct Redirect {
+    int fd;       // Descriptor redirected: 0-9, by default 0 for < and 1 for >
+    int op;       // REDIR_IN...REDIR_HEREDOC
+    char *target; // File name, descriptor digit or -, or here-document text
+    int expand;   // target has an expansion
+} Redirect;
+
+typedef struct Command {
+    char **argv; // NULL-terminated
+    int argc;
+    Redirect *redirs;
+    int nredirs;
+    int expand;       // Some word in argv has an expansion
+    Builtin *builtin; // Looked up when parsed, unless argv is expanded
+    // Compound commands. An if runs body or orelse (an elif is an if in
+    // orelse); loops run body while or until cond succeeds; for sets var
+    // to each word of argv in turn.
+    int type;
+    struct CommandList *cond, *body, *orelse;
+    char *var;
+} Command;
+
+typedef struct Pipeline {
+    Command *cmds;
+    int ncmds;
+    int op;         // How it follows the previous pipeline: 0, TOK_AND_IF or TOK_OR_IF
+    int background; // A lone pipeline ended by &
+    char *text;     // Source text, for the job table
+} Pipeline;
+
+// Pipelines joined by && and ||, ended by ; & or the end of the line
+typedef struct AndOr {
+    Pipeline *pipes;
+    int npipes;
+    int background; // Ended by & with more than one pipeline: run in a subshell
+    char *text;
+} AndOr;
+
+typedef struct CommandList {
+    AndOr *items;
+    int count;
+} CommandList;
+
+typedef struct Parser {
+    char *p;    // Next character of the line
+    Arena *arena;
+    char *buf;  // Scratch for the word being read
+    int tok;
+    char *word; // Text of a TOK_WORD
+    int expand;
+    int quoted; // Part of the word was quoted, so it is not a keyword
+    int redir_fd, redir_op;  // A TOK_REDIRECT
+    char *line_end, *body_end; // Newline before pending here-document bodies, and their end
+    char *start, *end;           // The current token in the line
+    char *prev_start, *prev_end; // The token before it
+    char *error;
+    int incomplete; // The error is the end of the text: more lines may fix it
+} Parser;
+
+// A script file compiled once and kept by path: while its mtime does not
+// change, running it again (-n, source) does not read or parse it
+typedef struct ScriptLine {
+    char *text;        // For history
+    CommandList *list; // NULL for a history reference like !n
+    char *error;       // Syntax error, reported when the line is reached
+} ScriptLine;
+
+typedef struct Script {
+    char *path; // NULL for a -c string
+    struct timespec mtime;
+    off_t size;
+    Arena arena; // Owns the text and the compiled lines
+    ScriptLine *lines;
+    int count;
+    int running; // Nesting count; not recompiled while running
+    struct Script *next;
+} Script;
+
+// How a stage's descriptors are set up, in order: fd becomes a copy of
+// from, or is closed when from is -1. Descriptors the shell opened for
+// the stage are owned, and closed once it has started.
+typedef struct FdMove {
+    int fd;
+    int from;
+    int owned;
+} FdMove;
+
+// Remembered location of a command, like bash's `hash`
+typedef struct CmdHash {
+    char *name;
+    char *path;
+    int hits;
+    struct CmdHash *next;
+} CmdHash;
+
+// A name in the completion index. For commands dir indexes comp_dirs (-1
+// for a builtin), and only regular executable files are indexed; in a
+// directory listing dir is 1 for subdirectories.
+typedef struct CompName {
+    char *name;
+    int dir;
+} CompName;
+
+typedef struct CompDir {
+    char *path;
+    struct timespec mtime;
+} CompDir;
+
+// Sorted listing of a directory for file name completion
+typedef struct DirListing {
+    char *dir;
+    struct timespec mtime;
+    CompName *names;
+    long count;
+} DirListing;
+
+// Resource usage of a finished command, from wait4()
+typedef struct JobStat {
+    int pid;
+    int job_number; // 0 for a foreground command
+    int status;     // Exit code, or 128 + signal
+    long long wall; // Nanoseconds from launch to reap
+    struct rusage usage;
+    char command[64];
+} JobStat;
+
+// Jobs live in a table indexed by job number, with released numbers on
+// a free-list, and are found by pid through an open-addressing map
+Job *jobs;           // jobs[n - 1] is job number n
+int job_capacity = 0;
+int job_high = 0;    // Highest job number handed out so far
+int *free_jobs;      // Stack of released job numbers
+int free_count = 0;
+int *pid_keys;       // pid -> job number, linear probing, 0 = empty
+int *pid_jobs;
+int pid_capacity = 0;
+int pid_count = 0;
+int job_control = 0; // Interactive: jobs get process groups and the terminal
+pid_t shell_pgid = 0;
+sigset_t job_signals; // Ignored (SIGINT: caught) by the shell, default again in children
+JobStat job_stats[JOBSTAT_SIZE]; // Ring of the most recently finished commands
+long job_stats_count = 0;
+int joblog_fd = -1; // Open JOBLOG file, and the path it was opened from
+char *joblog_path = NULL;
+// Variables: open addressing with linear probing. Names are interned in
+// var_names and stay with their slot after an unset, so setting the
+// variable again reuses both.
+Var *variables;
+int var_capacity = 0;
+int var_used = 0; // Slots with a name, set or unset
+Arena var_names;
+char **shell_env = NULL; // environ plus global variables, for execve()
+int env_dirty = 1;       // Set when a global variable changes
+Arena env_arena;         // Owns shell_env and its strings
 int job_count = 0;
-char *command_history[HIST_SIZE];
-int history_index = 0;
+// History is the mmap'ed file from earlier sessions followed by this
+// session's lines. The file is only indexed when history is first used,
+// so startup does not depend on its size. Entry n (from 1) is the n-th
+// line of the file, then the session lines.
+int hist_fd = -1;           // History file, opened O_APPEND
+const char *hist_map = NULL;
+size_t hist_map_size = 0;
+int hist_indexed = 0;
+HistEntry *hist_entries = NULL; // File lines followed by session lines
+long hist_count = 0;
+long hist_capacity = 0;
+Arena hist_arena;           // Text of this session's lines and decoded file lines
+GramList *grams = NULL;     // Trigram index, built on the first search
+unsigned int gram_capacity = 0;
+unsigned int gram_used = 0;
+long grams_indexed = 0;     // Entries 1..grams_indexed are in the index
+int use_fork = 0; // -F: launch with fork()+execvp instead of posix_spawn
+char *heap_ballast = NULL; // -H: resident heap, to compare launch costs as the heap grows
+CmdHash *cmd_hash[CMD_HASH_SIZE];
+long hash_hits = 0, hash_misses = 0;
+Arena comp_arena;           // Names and directories of the command index
+CompName *comp_names = NULL; // Builtins and PATH executables, sorted
+long comp_count = 0;
+CompDir *comp_dirs = NULL;
+int comp_dir_count = 0;
+char *comp_path = NULL;     // PATH the index was built from
+Arena listing_arena;
+DirListing listings[LISTING_CACHE_SIZE];
+int listing_count = 0;
+Arena cmd_arena; // Owns the current command line, its tokens and copies
+LineReader input = { STDIN_FILENO, NULL, 0, 0, 0, 0 };
+int interactive = 1; // 0 for scripts and -c: no prompt or status chatter
+int line_editing = 0; // Interactive input goes through edit_line()
+struct termios cooked_termios; // Terminal settings outside edit_line()
+LineEditor editor;
+Builtin *builtin_slots[BUILTIN_SLOTS];
+int builtin_slots_ready = 0;
+int last_status = 0; // Exit status of the last foreground command
+Pipeline *whole_line = NULL; // Pipeline of a running BUILTIN_WHOLE_LINE builtin
+Script *scripts = NULL;      // Compiled script files
+int source_depth = 0;
+int timing = 0; // -T: per-line latencies go to line_stats
+int loop_depth = 0; // Loops being run by the shell itself
+int loop_jump = 0;  // break/continue n: loops still to leave
+int loop_continue = 0; // The last of them goes on with its next iteration
+volatile sig_atomic_t interrupted = 0; // Ctrl-C: stop running the current line
+LatencyStats line_stats;
+int sigchld_pipe[2] = { -1, -1 }; // Self-pipe: the SIGCHLD handler only writes a byte here
+volatile sig_atomic_t child_exited = 0;
+volatile sig_atomic_t window_changed = 0; // SIGWINCH: the editor rereads the terminal width
 
-int execute(char *arglist[]);
-char **tokenize(char *cmdline);
-char *read_cmd();
+int run_pipeline(Pipeline *p);
+void run_and_or(AndOr *ao);
+void run_list(CommandList *list);
+void run_line(char *line);
+void run_compound(Command *cmd);
+int loop_done();
+pid_t fork_stage(FdMove *moves, int nmoves, pid_t pgid, int foreground);
+pid_t launch_subshell(AndOr *ao);
+pid_t launch_compound(Command *cmd, FdMove *moves, int nmoves, pid_t pgid, int foreground);
+int open_redirects(Command *cmd, FdMove *moves, int *nmoves);
+int fd_is_open(FdMove *moves, int nmoves, int fd);
+int heredoc_fd(const char *text);
+int high_fd(int fd);
+void apply_moves(FdMove *moves, int nmoves);
+void close_moves(FdMove *moves, int nmoves);
+pid_t launch(char *arglist[], FdMove *moves, int nmoves, pid_t pgid, int foreground);
+Builtin *find_stage_builtin(char *arglist[], int nstages);
+pid_t launch_builtin(Builtin *b, char *arglist[], FdMove *moves, int nmoves, pid_t pgid, int foreground);
+void run_builtin(Builtin *b, Command *cmd, char *arglist[]);
+unsigned int builtin_hash(const char *name);
+Builtin *find_builtin(const char *name);
+void builtin_cd(char *arglist[]);
+void builtin_exit(char *arglist[]);
+void builtin_jobs(char *arglist[]);
+void builtin_help(char *arglist[]);
+void builtin_set(char *arglist[]);
+void builtin_get(char *arglist[]);
+void builtin_listvars(char *arglist[]);
+void builtin_unset(char *arglist[]);
+void builtin_jobstat(char *arglist[]);
+void builtin_time(char *arglist[]);
+void builtin_cat(char *arglist[]);
+void builtin_tee(char *arglist[]);
+void builtin_echo(char *arglist[]);
+void builtin_true(char *arglist[]);
+void builtin_false(char *arglist[]);
+void builtin_test(char *arglist[]);
+void builtin_printf(char *arglist[]);
+void builtin_pwd(char *arglist[]);
+void builtin_source(char *arglist[]);
+void builtin_break(char *arglist[]);
+int print_escaped(const char *s, int zero_octal);
+void check_output(const char *name);
+int test_expr(char **args, int n);
+int test_or(char **args, int n, int *pos);
+int test_primary(char **args, int n, int *pos);
+int test_unary(const char *op, const char *arg);
+int test_binary(const char *left, const char *op, const char *right);
+int is_test_unary(const char *op);
+int is_test_binary(const char *op);
+long long test_integer(const char *s);
+const char *printf_format(const char *fmt, char ***args, int *used);
+void child_job_setup(pid_t pgid, int foreground);
+int copy_fd(int in_fd, int out_fd);
+int cat_stage(char *arglist[]);
+int tee_stage(char *arglist[]);
+CommandList *parse_line(Arena *a, char *text, char **error, int *incomplete);
+void parser_init(Parser *ps, Arena *a, char *text);
+int parse_list(Parser *ps, CommandList *list, int compound);
+CommandList *parse_part(Parser *ps);
+int parse_and_or(Parser *ps, AndOr *ao);
+int parse_pipeline(Parser *ps, Pipeline *p);
+int parse_command(Parser *ps, Command *cmd);
+int parse_if(Parser *ps, Command *cmd);
+int parse_loop(Parser *ps, Command *cmd);
+int parse_for(Parser *ps, Command *cmd);
+int parse_redirect(Parser *ps, Command *cmd);
+int read_heredoc(Parser *ps, Redirect *r, const char *delim, int strip_tabs, int literal);
+void add_word(Parser *ps, Command *cmd);
+void finish_words(Parser *ps, Command *cmd);
+int is_keyword(Parser *ps, const char *word);
+int ends_part(Parser *ps);
+int expect_keyword(Parser *ps, const char *word);
+void next_token(Parser *ps);
+int syntax_error(Parser *ps, const char *fmt);
+int need_more(Parser *ps, const char *what);
+char *history_text(Arena *a, const char *text, size_t len);
+void unescape_word(char *word);
+char *escape_char(char *out, char c);
+char *copy_expansion(Parser *ps, char *out, char **p);
+void *arena_push(Arena *a, void *base, int *count, size_t size);
+char *arena_strndup(Arena *a, const char *s, size_t len);
+Script *load_script(const char *path);
+void compile_script(Script *s, char *text);
+void run_script(Script *s);
+char *read_cmd(const char *prompt);
+char *edit_line(const char *prompt);
+int editor_key();
+void editor_put(const char *s, size_t n);
+void editor_flush();
+size_t text_width(const char *s, size_t n);
+size_t editor_column(size_t pos);
+size_t editor_prev(size_t pos);
+size_t editor_next(size_t pos);
+void editor_size();
+void editor_cursor(size_t from, size_t to);
+void editor_goto(size_t pos);
+void editor_put_tail(size_t pos);
+void editor_clear();
+void editor_refresh(const char *prompt);
+void editor_insert(const char *s, size_t n);
+void editor_delete(size_t n);
+void editor_replace(const char *text, size_t n);
+void editor_history(long step);
+void editor_complete(const char *prompt);
+void refresh_command_index();
+void build_command_index(char *path);
+CompName *lookup_names(CompName *names, long count, const char *prefix, long *n);
+DirListing *dir_listing(char *dir);
+void clear_dir_listings();
+char *search_path();
+char *remember_command(char *name, char *path, unsigned int bucket);
+void open_history();
+void index_history();
+void history_decode(HistEntry *e);
 void add_to_history(char *cmdline);
+char *history_line(long n);
+void index_entry(long n);
+void index_grams();
+GramList *find_gram(unsigned int gram);
+int search_candidates(const char *pat, int prefix, unsigned int **ids, long *count);
+int history_matches(long n, const char *pat, size_t len, int prefix);
+long history_find(const char *pat, int prefix);
+void search_history(char *pat, int prefix);
+void show_history(char *arglist[]);
 void repeat_command(char *cmdline);
 void sigchld_handler(int signo);
+void sigwinch_handler(int signo);
+void sigint_handler(int signo);
 void change_directory(char *path);
 void show_jobs();
-void kill_job(int job_number);
-void kill_job_by_pid(int pid);
+void kill_command(char *arglist[]);
+void kill_job(int job_number, int sig);
+void kill_job_by_pid(int pid, int sig);
 void show_help();
-void remove_job(int pid);
+void remove_job(Job *job);
+Job *add_job(int *pids, int npids, int pgid, char *command, long long started);
+int job_stage_done(Job *job, int pid, int status, struct rusage *usage);
+void wait_foreground(Job *job);
+Job *job_from_arg(char *arg);
+void fg_command(char *arglist[]);
+void bg_command(char *arglist[]);
+Job *find_job(int job_number);
+Job *find_job_by_pid(int pid);
+void pid_map_put(int pid, int job_number);
+void pid_map_delete(int pid);
+void run_parallel(char *arglist[]);
+void record_exit(int pid, int job_number, char *command, long long started, int status, struct rusage *usage);
+void show_jobstat();
+void reap_children();
+int wait_for_input(int fd);
 void set_variable(char *name, char *value, int global);
 char *get_variable(char *name);
 void list_variables();
-void free_variable(int index);
+int unset_variable(char *name);
+Var *find_variable(char *name, unsigned int hash);
+void grow_variables();
+char **command_words(Command *cmd);
+char *expand_word(char *word);
+int is_name_char(char c, int first);
+char *lookup_variable(char *name);
+char **exec_env();
+unsigned int hash_string(const char *s);
+char *find_command(char *name);
+void forget_command(char *name);
+void clear_command_hash();
+void hash_command(char *arglist[]);
+void *arena_alloc(Arena *a, size_t size);
+char *arena_strdup(Arena *a, const char *s);
+void arena_reset(Arena *a);
+void arena_rewind(Arena *a, Arena *mark);
+char *reader_getline(LineReader *r);
+int reader_rewind(LineReader *r);
+void process_line(char *cmdline);
+void run_command(char *arglist[]);
+void time_command(char *arglist[]);
+void bench_command(char *arglist[]);
+void print_histogram(LatencyStats *st);
+long long now_ns();
+void stats_add(LatencyStats *st, long long ns);
+long long stats_percentile(LatencyStats *st, double pct);
+void report_line_stats(double seconds);
 
-int main() {
+Builtin builtins[] = {
+    { "cd", builtin_cd, 0 },
+    { "exit", builtin_exit, 0 },
+    { "jobs", builtin_jobs, 0 },
+    { "kill", kill_command, 0 },
+    { "fg", fg_command, 0 },
+    { "bg", bg_command, 0 },
+    { "help", builtin_help, 0 },
+    { "set", builtin_set, 0 },
+    { "get", builtin_get, 0 },
+    { "listvars", builtin_listvars, 0 },
+    { "unset", builtin_unset, 0 },
+    { "hash", hash_command, 0 },
+    { "parallel", run_parallel, 0 },
+    { "jobstat", builtin_jobstat, 0 },
+    { "history", show_history, 0 },
+    { "time", builtin_time, BUILTIN_WHOLE_LINE },
+    { "bench", bench_command, BUILTIN_WHOLE_LINE },
+    { "echo", builtin_echo, 0 },
+    { "true", builtin_true, 0 },
+    { "false", builtin_false, 0 },
+    { "test", builtin_test, 0 },
+    { "[", builtin_test, 0 },
+    { "printf", builtin_printf, 0 },
+    { "pwd", builtin_pwd, 0 },
+    { "source", builtin_source, 0 },
+    { ".", builtin_source, 0 },
+    { "break", builtin_break, 0 },
+    { "continue", builtin_break, 0 },
+    { "cat", builtin_cat, BUILTIN_PIPE_ONLY },
+    { "tee", builtin_tee, BUILTIN_PIPE_ONLY },
+    { NULL, NULL, 0 }
+};
+
+int main(int argc, char *argv[]) {
     char *cmdline;
-    char **arglist;
+    char *command = NULL;
+    Script *script = NULL;
+    long repeat = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Fc:Tn:H:")) != -1) {
+        if (opt == 'F') {
+            use_fork = 1;
+        } else if (opt == 'c') {
+            command = optarg;
+        } else if (opt == 'T') {
+            timing = 1;
+        } else if (opt == 'n') {
+            repeat = atol(optarg);
+        } else if (opt == 'H') {
+            // Every page is written, so fork() has that much to copy
+            size_t size = (size_t)atol(optarg) << 20;
+            heap_ballast = malloc(size);
+            if (heap_ballast == NULL) {
+                perror("-H");
+                exit(2);
+            }
+            memset(heap_ballast, 1, size);
+        } else {
+            fprintf(stderr, "Usage: %s [-F] [-T] [-H MiB] [-n count] [-c command | script]\n", argv[0]);
+            exit(2);
+        }
+    }
+
+    // A script or -c string is compiled up front and run from its
+    // compiled form, as often as -n asks
+    if (command != NULL) {
+        script = calloc(1, sizeof(Script));
+        compile_script(script, arena_strdup(&script->arena, command));
+        interactive = 0;
+    } else if (optind < argc) {
+        script = load_script(argv[optind]);
+        if (script == NULL) {
+            exit(127);
+        }
+        interactive = 0;
+    } else {
+        interactive = isatty(STDIN_FILENO);
+    }
+    char *term = getenv("TERM");
+    if (interactive && (term == NULL || strcmp(term, "dumb") != 0) &&
+        tcgetattr(STDIN_FILENO, &cooked_termios) == 0) {
+        line_editing = 1;
+    }
+    if (interactive) {
+        open_history();
+    }
+
+    // Job control: wait until we are in the terminal's foreground, then
+    // lead our own process group and ignore the job control signals
+    if (interactive && tcgetpgrp(STDIN_FILENO) >= 0) {
+        while (tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+            kill(-getpgrp(), SIGTTIN);
+        }
+        sigemptyset(&job_signals);
+        int ignored[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+        for (int i = 0; i < 5; i++) {
+            signal(ignored[i], SIG_IGN);
+            sigaddset(&job_signals, ignored[i]);
+        }
+        struct sigaction intr;
+        intr.sa_handler = sigint_handler;
+        sigemptyset(&intr.sa_mask);
+        intr.sa_flags = SA_RESTART;
+        sigaction(SIGINT, &intr, NULL);
+        if (getpgrp() != getpid()) {
+            setpgid(0, 0);
+        }
+        shell_pgid = getpgrp();
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcgetattr(STDIN_FILENO, &cooked_termios);
+        job_control = 1;
+    }
 
-    // Set up signal handler for SIGCHLD
+    // Set up signal handler for SIGCHLD. Children are reaped by the main
+    // loop, never in the handler, so the job table is only touched there.
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    sigchld_pipe[0] = high_fd(sigchld_pipe[0]);
+    sigchld_pipe[1] = high_fd(sigchld_pipe[1]);
     struct sigaction sa;
     sa.sa_handler = sigchld_handler;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sa.sa_flags = SA_RESTART; // Stops are reported too, for Ctrl-Z
     sigaction(SIGCHLD, &sa, NULL);
+    if (line_editing) {
+        sa.sa_handler = sigwinch_handler;
+        sigaction(SIGWINCH, &sa, NULL);
+    }
 
-    while (1) {
-        cmdline = read_cmd();
+    long long started = now_ns();
+    while (script != NULL && repeat-- > 0) {
+        run_script(script);
+    }
+    while (script == NULL) {
+        cmdline = read_cmd(PROMPT);
         if (cmdline == NULL) {
+            // -n replays input redirected from a file that many times
+            if (--repeat > 0 && reader_rewind(&input) == 0) {
+                continue;
+            }
             break; // Exit on EOF
         }
-        if (cmdline[0] == '!') {
-            repeat_command(cmdline);
-            free(cmdline);
+        if (timing) {
+            long long t = now_ns();
+            process_line(cmdline);
+            stats_add(&line_stats, now_ns() - t);
+        } else {
+            process_line(cmdline);
+        }
+        arena_reset(&cmd_arena);
+        if (child_exited) {
+            reap_children();
+        }
+    }
+    if (interactive) {
+        printf("\n");
+    }
+    if (timing) {
+        report_line_stats((now_ns() - started) / 1e9);
+    }
+    return last_status;
+}
+
+// A command that is not finished at the end of the line, like `if true`
+// or `a |`, goes on with the lines read after it. History gets it as one
+// line.
+void process_line(char *cmdline) {
+    interrupted = 0;
+    if (cmdline[0] == '!') {
+        repeat_command(cmdline);
+        return;
+    }
+    char *error;
+    int incomplete;
+    CommandList *list = parse_line(&cmd_arena, cmdline, &error, &incomplete);
+    while (list == NULL && incomplete) {
+        size_t len = strlen(cmdline);
+        char *text = arena_strndup(&cmd_arena, cmdline, len);
+        char *more = read_cmd(PS2);
+        if (more == NULL) {
+            break;
+        }
+        size_t n = strlen(more);
+        cmdline = arena_alloc(&cmd_arena, len + n + 2);
+        memcpy(cmdline, text, len);
+        cmdline[len] = '\n';
+        memcpy(cmdline + len + 1, more, n + 1);
+        list = parse_line(&cmd_arena, cmdline, &error, &incomplete);
+    }
+    if (interactive)
+        add_to_history(history_text(&cmd_arena, cmdline, strlen(cmdline)));
+    if (list == NULL) {
+        fprintf(stderr, "%s\n", error);
+        last_status = 2;
+        return;
+    }
+    run_list(list);
+}
+
+// Compile a line from history into cmd_arena and run it
+void run_line(char *line) {
+    char *error;
+    int incomplete;
+    CommandList *list = parse_line(&cmd_arena, line, &error, &incomplete);
+    if (list == NULL) {
+        fprintf(stderr, "%s\n", error);
+        last_status = 2;
+        return;
+    }
+    run_list(list);
+}
+
+// A pending break or continue, or Ctrl-C, skips the rest of the list
+void run_list(CommandList *list) {
+    for (int i = 0; i < list->count && !loop_jump && !interrupted; i++) {
+        run_and_or(&list->items[i]);
+    }
+}
+
+// && runs the next pipeline only after a success, || only after a failure
+void run_and_or(AndOr *ao) {
+    if (ao->background) {
+        pid_t pid = launch_subshell(ao);
+        if (pid > 0 && interactive) {
+            printf("Started background process with PID %d\n", pid);
+        }
+        return;
+    }
+    for (int i = 0; i < ao->npipes; i++) {
+        Pipeline *p = &ao->pipes[i];
+        if ((p->op == TOK_AND_IF && last_status != 0) || (p->op == TOK_OR_IF && last_status == 0)) {
             continue;
         }
-        add_to_history(cmdline);
-        if ((arglist = tokenize(cmdline)) != NULL) {
-            // Check for built-in commands first
-            if (strcmp(arglist[0], "cd") == 0) {
-                change_directory(arglist[1]);
-            } else if (strcmp(arglist[0], "exit") == 0) {
-                free(cmdline);
-                free(arglist);
-                exit(0);
-            } else if (strcmp(arglist[0], "jobs") == 0) {
-                show_jobs();
-            } else if (strcmp(arglist[0], "kill") == 0) {
-                if (arglist[1] != NULL) {
-                    int pid = atoi(arglist[1]);
-                    if (pid > 0) {
-                        // Attempt to kill by PID first
-                        kill_job_by_pid(pid);
-                    } else {
-                        // Otherwise, attempt to kill by job number
-                        int job_number = atoi(arglist[1]);
-                        kill_job(job_number);
-                    }
-                } else {
-                    fprintf(stderr, "Usage: kill <job_number or pid>\n");
-                }
-            } else if (strcmp(arglist[0], "help") == 0) {
-                show_help();
-            } else if (strcmp(arglist[0], "set") == 0 && arglist[1] != NULL && arglist[2] != NULL) {
-                int global = (arglist[3] != NULL && strcmp(arglist[3], "global") == 0) ? 1 : 0;
-                set_variable(arglist[1], arglist[2], global);
-            } else if (strcmp(arglist[0], "get") == 0 && arglist[1] != NULL) {
-                char *value = get_variable(arglist[1]);
-                if (value != NULL) {
-                    printf("%s = %s\n", arglist[1], value);
-                } else {
-                    printf("Variable %s not found\n", arglist[1]);
-                }
-            } else if (strcmp(arglist[0], "listvars") == 0) {
-                list_variables();
-            } else {
-                execute(arglist);
-            }
-            for (int j = 0; j < MAXARGS + 1; j++)
-                free(arglist[j]);
-            free(arglist);
+        if (loop_jump || interrupted) {
+            break;
         }
-        free(cmdline);
+        run_pipeline(p);
     }
-    printf("\n");
-    return 0;
 }
-// Add to command history
-void add_to_history(char *cmdline) {
-    free(command_history[history_index]);
-    command_history[history_index] = strdup(cmdline);
-    history_index = (history_index + 1) % HIST_SIZE;
+
+// `a && b &`: the whole list runs in a forked copy of the shell, as one job
+pid_t launch_subshell(AndOr *ao) {
+    pid_t pgid = job_control ? 0 : -1;
+    long long started = now_ns();
+    pid_t pid = fork_stage(NULL, 0, pgid, 0);
+    if (pid == 0) {
+        AndOr fg = *ao;
+        fg.background = 0;
+        run_and_or(&fg);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid > 0)
+        add_job(&pid, 1, pgid >= 0 ? pid : 0, ao->text, started);
+    return pid;
 }
 
-// Repeat a command from history
-void repeat_command(char *cmdline) {
-    int cmd_num;
-    if (sscanf(cmdline + 1, "%d", &cmd_num) != 1) {
-        fprintf(stderr, "Invalid command number\n");
+// Run an if, while, until or for in the shell itself: only the commands
+// inside it start processes. Each loop iteration gives back what it
+// allocated in cmd_arena.
+void run_compound(Command *cmd) {
+    if (cmd->type == CMD_IF) {
+        run_list(cmd->cond);
+        if (loop_jump || interrupted)
+            return;
+        if (last_status == 0)
+            run_list(cmd->body);
+        else if (cmd->orelse != NULL)
+            run_list(cmd->orelse);
+        else
+            last_status = 0;
         return;
     }
-    
-    if (cmd_num == -1) {
-        cmd_num = (history_index - 1 + HIST_SIZE) % HIST_SIZE;
-    } else {
-        cmd_num = (cmd_num - 1) % HIST_SIZE;
-    }
-    
-    if (command_history[cmd_num] != NULL) {
-        printf("%s\n", command_history[cmd_num]);
-        char *cmdline = strdup(command_history[cmd_num]);
-        
-        char **arglist = tokenize(cmdline);
-        
-        if (arglist != NULL) {
-            if (strcmp(arglist[0], "cd") == 0) {
-                change_directory(arglist[1]);
-            } else {
-                execute(arglist);
-            }
-            for (int j = 0; j < MAXARGS + 1; j++)
-                free(arglist[j]);
-            free(arglist);
+
+    int status = 0;
+    loop_depth++;
+    if (cmd->type == CMD_FOR) {
+        char **words = command_words(cmd);
+        Arena mark = cmd_arena;
+        for (int i = 0; words[i] != NULL; i++) {
+            set_variable(cmd->var, words[i], 0);
+            run_list(cmd->body);
+            status = last_status;
+            if (loop_done())
+                break;
+            arena_rewind(&cmd_arena, &mark);
         }
-        free(cmdline);
     } else {
-        fprintf(stderr, "No command found for that number\n");
+        Arena mark = cmd_arena;
+        while (1) {
+            run_list(cmd->cond);
+            if (loop_done() || (last_status == 0) != (cmd->type == CMD_WHILE))
+                break;
+            run_list(cmd->body);
+            status = last_status;
+            if (loop_done())
+                break;
+            arena_rewind(&cmd_arena, &mark);
+        }
     }
+    loop_depth--;
+    last_status = status;
 }
 
-int execute(char *arglist[]) {
-    int status;
-    pid_t cpid;
-    int i = 0;
-    int inRedirect = -1, outRedirect = -1;
-    int background = 0;
+// After part of a loop has run: 1 if the loop stops there, for Ctrl-C or
+// a break or continue meant for a loop around it
+int loop_done() {
+    if (interrupted) {
+        return 1;
+    }
+    if (loop_jump == 0 || --loop_jump > 0) {
+        return loop_jump > 0;
+    }
+    if (loop_continue) {
+        loop_continue = 0;
+        return 0;
+    }
+    return 1;
+}
 
-    while (arglist[i] != NULL) {
-        if (strcmp(arglist[i], "<") == 0) {
-            inRedirect = i;
-        } else if (strcmp(arglist[i], ">") == 0) {
-            outRedirect = i;
-        }
-        i++;
+// A compound command as a pipeline stage or in the background
+pid_t launch_compound(Command *cmd, FdMove *moves, int nmoves, pid_t pgid, int foreground) {
+    pid_t pid = fork_stage(moves, nmoves, pgid, foreground);
+    if (pid == 0) {
+        run_compound(cmd);
+        fflush(stdout);
+        _exit(last_status);
     }
+    return pid;
+}
 
-    if (arglist[i - 1] != NULL && strcmp(arglist[i - 1], "&") == 0) {
-        background = 1;
-        arglist[i - 1] = NULL;
+// Run arglist, already expanded, as a command. From a BUILTIN_WHOLE_LINE
+// builtin it takes the place of the builtin's own words in its pipeline,
+// so `time a | b > f &` times the whole pipeline.
+void run_command(char *arglist[]) {
+    Pipeline p = { NULL, 1, 0, 0, NULL };
+    Command first = { arglist, 0, NULL, 0, 0, NULL, CMD_SIMPLE, NULL, NULL, NULL, NULL };
+    if (whole_line != NULL) {
+        p = *whole_line;
+        first = whole_line->cmds[0]; // Keeps its redirections
+        first.argv = arglist;
+        first.expand = 0;
     }
+    while (arglist[first.argc] != NULL)
+        first.argc++;
+    first.builtin = first.argc > 0 ? find_builtin(arglist[0]) : NULL;
+    Command cmds[p.ncmds];
+    if (whole_line != NULL)
+        memcpy(cmds, whole_line->cmds, p.ncmds * sizeof(Command));
+    cmds[0] = first;
+    p.cmds = cmds;
 
-    cpid = fork();
-    if (cpid == 0) {
-        if (inRedirect != -1) {
-            int fd = open(arglist[inRedirect + 1], O_RDONLY);
-            if (fd < 0) {
-                perror("Failed to open file for reading");
-                exit(1);
+    Pipeline *outer = whole_line;
+    whole_line = NULL;
+    run_pipeline(&p);
+    whole_line = outer;
+}
+
+// Builtins are placed by a perfect hash of the name: the parameters were
+// picked so that every builtin gets its own slot, and find_builtin()
+// checks that when it fills the table. A lookup is one probe and one
+// strcmp.
+unsigned int builtin_hash(const char *name) {
+    size_t len = strlen(name);
+    unsigned char first = name[0], second = len > 1 ? name[1] : 0, last = name[len - 1];
+    return (first + 37u * second + 31u * last + len) & (BUILTIN_SLOTS - 1);
+}
+
+Builtin *find_builtin(const char *name) {
+    if (!builtin_slots_ready) {
+        for (Builtin *b = builtins; b->name != NULL; b++) {
+            Builtin **slot = &builtin_slots[builtin_hash(b->name)];
+            if (*slot != NULL) {
+                fprintf(stderr, "builtin %s collides with %s: change builtin_hash()\n", b->name, (*slot)->name);
+                abort();
             }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-            arglist[inRedirect] = NULL;
+            *slot = b;
         }
+        builtin_slots_ready = 1;
+    }
+    if (name[0] == '\0') {
+        return NULL;
+    }
+    Builtin *b = builtin_slots[builtin_hash(name)];
+    return b != NULL && strcmp(b->name, name) == 0 ? b : NULL;
+}
 
-        if (outRedirect != -1) {
-            int fd = open(arglist[outRedirect + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("Failed to open file for writing");
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            arglist[outRedirect] = NULL;
+// Run a builtin, or a compound command when b is NULL, in the shell; its
+// redirections last for the call only. The shell's own copy of each
+// descriptor it moves is kept above FD_HIGH and put back afterwards.
+void run_builtin(Builtin *b, Command *cmd, char *arglist[]) {
+    FdMove moves[cmd->nredirs + 1];
+    int nmoves = 0;
+    if (open_redirects(cmd, moves, &nmoves) < 0) {
+        return;
+    }
+    if (b != NULL)
+        last_status = 0; // Builtins succeed unless they say otherwise
+    if (nmoves == 0) {
+        if (b != NULL)
+            b->fn(arglist);
+        else
+            run_compound(cmd);
+        return;
+    }
+    fflush(stdout);
+    int saved[nmoves]; // -1: fd was closed, -2: saved by an earlier move
+    for (int i = 0; i < nmoves; i++) {
+        int fd = moves[i].fd;
+        saved[i] = -1;
+        for (int j = 0; j < i; j++) {
+            if (moves[j].fd == fd)
+                saved[i] = -2;
         }
+        if (saved[i] == -1)
+            saved[i] = fcntl(fd, F_DUPFD_CLOEXEC, FD_HIGH);
+    }
+    apply_moves(moves, nmoves);
+    close_moves(moves, nmoves);
+    if (b != NULL)
+        b->fn(arglist);
+    else
+        run_compound(cmd);
+    fflush(stdout);
+    for (int i = nmoves - 1; i >= 0; i--) {
+        if (saved[i] == -1) {
+            close(moves[i].fd);
+        } else if (saved[i] >= 0) {
+            dup2(saved[i], moves[i].fd);
+            close(saved[i]);
+        }
+    }
+}
 
-        execvp(arglist[0], arglist);
-        perror("Command not found...");
-        exit(1);
+void builtin_cd(char *arglist[]) {
+    change_directory(arglist[1]);
+}
+
+void builtin_exit(char *arglist[]) {
+    exit(arglist[1] != NULL ? atoi(arglist[1]) : last_status);
+}
+
+void builtin_jobs(char *arglist[]) {
+    (void)arglist;
+    show_jobs();
+}
+
+void builtin_help(char *arglist[]) {
+    (void)arglist;
+    show_help();
+}
+
+void builtin_set(char *arglist[]) {
+    if (arglist[1] == NULL || arglist[2] == NULL) {
+        fprintf(stderr, "Usage: set <name> <value> [global]\n");
+        last_status = 2;
+        return;
+    }
+    int global = (arglist[3] != NULL && strcmp(arglist[3], "global") == 0) ? 1 : 0;
+    set_variable(arglist[1], arglist[2], global);
+}
+
+void builtin_get(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: get <name>\n");
+        last_status = 2;
+        return;
+    }
+    char *value = get_variable(arglist[1]);
+    if (value != NULL) {
+        printf("%s = %s\n", arglist[1], value);
     } else {
-        if (background) {
-            jobs[job_count].pid = cpid;
-            jobs[job_count].job_number = job_count + 1;
-            strncpy(jobs[job_count].command, arglist[0], MAX_LEN);
-            printf("Started background process with PID %d\n", cpid);
-            job_count++;
-        } else {
-            waitpid(cpid, &status, 0);
-            printf("Child exited with status %d\n", status >> 8);
-        }
-        return 0;
+        printf("Variable %s not found\n", arglist[1]);
+        last_status = 1;
     }
 }
 
-void sigchld_handler(int signo) {
-    int saved_errno = errno;
-    pid_t pid;
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        printf("Job with PID %d terminated.\n", pid); // Message when job is terminated
-        remove_job(pid);
+void builtin_listvars(char *arglist[]) {
+    (void)arglist;
+    list_variables();
+}
+
+void builtin_unset(char *arglist[]) {
+    for (int i = 1; arglist[i] != NULL; i++) {
+        unset_variable(arglist[i]);
     }
-    errno = saved_errno;
 }
 
-char **tokenize(char *cmdline) {
-    char **arglist = (char **)malloc(sizeof(char *) * (MAXARGS + 1));
-    for (int j = 0; j < MAXARGS + 1; j++) {
-        arglist[j] = (char *)malloc(sizeof(char) * ARGLEN);
+void builtin_jobstat(char *arglist[]) {
+    (void)arglist;
+    show_jobstat();
+}
+
+void builtin_time(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: time <command>\n");
+        last_status = 2;
+        return;
     }
+    time_command(arglist + 1);
+}
+
+void builtin_cat(char *arglist[]) {
+    last_status = cat_stage(arglist);
+}
+
+void builtin_tee(char *arglist[]) {
+    last_status = tee_stage(arglist);
+}
 
-    int argnum = 0;
-    char *start = cmdline;
-    while (*start) {
-        while (*start == ' ') start++;
-        if (*start == '\0') break;
+// The utilities below match coreutils, so scripts full of them need no
+// fork or exec at all
 
-        char *end = start;
-        while (*end && *end != ' ') end++;
-        int len = end - start;
-        if (len > 0) {
-            strncpy(arglist[argnum], start, len);
-            arglist[argnum][len] = '\0';
-            argnum++;
+// echo [-neE] [arg...]: an argument is an option only if it is made up
+// entirely of n, e and E
+void builtin_echo(char *arglist[]) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && arglist[i][1] != '\0'; i++) {
+        if (strspn(arglist[i] + 1, "neE") != strlen(arglist[i] + 1)) {
+            break;
+        }
+        for (char *c = arglist[i] + 1; *c; c++) {
+            if (*c == 'n')
+                newline = 0;
+            else
+                escapes = (*c == 'e');
+        }
+    }
+    for (int first = i; arglist[i] != NULL; i++) {
+        if (i > first)
+            putchar(' ');
+        if (!escapes)
+            fputs(arglist[i], stdout);
+        else if (print_escaped(arglist[i], 1)) {
+            newline = 0; // \c: no more output, not even the newline
+            break;
         }
-        start = end;
     }
-    arglist[argnum] = NULL;
-    return arglist;
+    if (newline)
+        putchar('\n');
+    check_output("echo");
 }
 
-char *read_cmd() {
-    char *cmdline = (char *)malloc(sizeof(char) * MAX_LEN);
-    printf(PROMPT);
-    if (fgets(cmdline, MAX_LEN, stdin) == NULL) {
-        free(cmdline);
-        return NULL; // EOF
+// Flush stdout and fail like coreutils if anything could not be written,
+// e.g. "echo: write error: No space left on device"
+void check_output(const char *name) {
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+        clearerr(stdout);
+        last_status = 1;
     }
-    cmdline[strcspn(cmdline, "\n")] = '\0'; // Remove newline
-    return cmdline;
 }
 
-void change_directory(char *path) {
-    if (path == NULL || chdir(path) != 0) {
-        perror("cd failed");
-    }
+void builtin_true(char *arglist[]) {
+    (void)arglist;
+    last_status = 0;
 }
 
-void show_jobs() {
-    for (int i = 0; i < job_count; i++) {
-        printf("[%d] %d %s\n", jobs[i].job_number, jobs[i].pid, jobs[i].command);
+void builtin_false(char *arglist[]) {
+    (void)arglist;
+    last_status = 1;
+}
+
+void builtin_pwd(char *arglist[]) {
+    int logical = arglist[1] != NULL && strcmp(arglist[1], "-L") == 0;
+    char *pwd = getenv("PWD");
+    struct stat a, b;
+    if (logical && pwd != NULL && pwd[0] == '/' && stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        printf("%s\n", pwd);
+        return;
     }
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        last_status = 1;
+        return;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
 }
 
-void kill_job(int job_number) {
-    if (job_number > 0 && job_number <= job_count) {
-        pid_t pid = jobs[job_number - 1].pid;
-        if (kill(pid, SIGKILL) == 0) {
-            printf("Killed job [%d] with PID %d: %s\n", job_number, pid, jobs[job_number - 1].command);
-            remove_job(pid);
-        } else {
-            perror("Failed to kill job");
-        }
-    } else {
-        fprintf(stderr, "No such job number\n");
+// source FILE, . FILE: run a script in this shell. It is compiled once
+// per version of the file, see load_script().
+void builtin_source(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: %s <file>\n", arglist[0]);
+        last_status = 2;
+        return;
     }
+    if (source_depth == SOURCE_DEPTH) {
+        fprintf(stderr, "%s: nested too deeply\n", arglist[0]);
+        last_status = 1;
+        return;
+    }
+    Script *s = load_script(arglist[1]);
+    if (s == NULL) {
+        last_status = 1;
+        return;
+    }
+    source_depth++;
+    run_script(s);
+    source_depth--;
 }
-void kill_job_by_pid(int pid) {
-    if (kill(pid, SIGKILL) == 0) {
-        printf("Killed job with PID %d\n", pid);
-        remove_job(pid);
-    } else {
-        perror("Failed to kill job by PID");
+
+// break [n] and continue [n] act on the n-th enclosing loop
+void builtin_break(char *arglist[]) {
+    long n = arglist[1] != NULL ? atol(arglist[1]) : 1;
+    if (n < 1) {
+        fprintf(stderr, "%s: %s: loop count out of range\n", arglist[0], arglist[1]);
+        last_status = 1;
+        return;
     }
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", arglist[0]);
+        return;
+    }
+    loop_jump = n < loop_depth ? n : loop_depth;
+    loop_continue = (arglist[0][0] == 'c');
 }
-void remove_job(int pid) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid == pid) {
-            for (int j = i; j < job_count - 1; j++) {
-                jobs[j] = jobs[j + 1];
+
+// Write s with backslash escapes interpreted. With zero_octal (echo -e,
+// printf %b) a leading 0 in an octal escape does not count as a digit.
+// Returns 1 when \c asks for all output to stop.
+int print_escaped(const char *s, int zero_octal) {
+    for (; *s; s++) {
+        if (*s != '\\' || s[1] == '\0') {
+            putchar(*s);
+            continue;
+        }
+        s++;
+        const char *simple = strchr("\\abefnrtv\"", *s);
+        if (simple != NULL && *s != '\0') {
+            putchar("\\\a\b\033\f\n\r\t\v\""[simple - "\\abefnrtv\""]);
+        } else if (*s == 'c') {
+            return 1;
+        } else if (*s == 'x' && isxdigit((unsigned char)s[1])) {
+            int c = 0;
+            for (int n = 0; n < 2 && isxdigit((unsigned char)s[1]); n++) {
+                s++;
+                c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (tolower((unsigned char)*s) - 'a' + 10));
             }
-            job_count--;
+            putchar(c);
+        } else if (*s >= '0' && *s <= '7') {
+            int c = 0, n = 0;
+            if (zero_octal && *s == '0')
+                s++;
+            for (; n < 3 && *s >= '0' && *s <= '7'; n++, s++)
+                c = c * 8 + *s - '0';
+            s--;
+            putchar(c);
+        } else {
+            putchar('\\');
+            putchar(*s);
+        }
+    }
+    return 0;
+}
+
+// test EXPR, [ EXPR ]: 0 if true, 1 if false, 2 on a usage error
+void builtin_test(char *arglist[]) {
+    int n = 0;
+    while (arglist[n + 1] != NULL)
+        n++;
+    if (strcmp(arglist[0], "[") == 0) {
+        if (n == 0 || strcmp(arglist[n], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            last_status = 2;
             return;
         }
+        n--;
     }
+    last_status = test_expr(arglist + 1, n);
 }
 
-void show_help() {
-    printf("Available commands:\n");
-    printf("  cd <path>            - Change directory\n");
-    printf("  exit                 - Exit shell\n");
-    printf("  jobs                 - Show background jobs\n");
-    printf("  kill <job_number>    - Kill job by job number\n");
-    printf("  kill <pid>          - Kill job by PID\n");
-    printf("  help                 - Show this help message\n");
-    printf("  set <name> <value>   - Set variable\n");
-    printf("  get <name>           - Get variable value\n");
-    printf("  listvars             - List all variables\n");
+// POSIX fixes the meaning of up to four arguments; longer expressions
+// are parsed with -o binding looser than -a, then !, ( ) and primaries
+int test_expr(char **args, int n) {
+    int result;
+    if (n == 0) {
+        return 1;
+    } else if (n == 1) {
+        return args[0][0] == '\0';
+    } else if (n == 2 && strcmp(args[0], "!") == 0) {
+        return !test_expr(args + 1, 1);
+    } else if (n == 2 && is_test_unary(args[0])) {
+        return test_unary(args[0], args[1]);
+    } else if (n == 3 && is_test_binary(args[1])) {
+        return test_binary(args[0], args[1], args[2]);
+    } else if (n == 3 && (strcmp(args[1], "-a") == 0 || strcmp(args[1], "-o") == 0)) {
+        int left = args[0][0] == '\0', right = args[2][0] == '\0';
+        return args[1][1] == 'a' ? (left || right) : (left && right);
+    } else if ((n == 3 || n == 4) && strcmp(args[0], "!") == 0) {
+        result = test_expr(args + 1, n - 1);
+        return result == 2 ? 2 : !result;
+    } else if ((n == 3 || n == 4) && strcmp(args[0], "(") == 0 && strcmp(args[n - 1], ")") == 0) {
+        return test_expr(args + 1, n - 2);
+    } else if (n == 2) {
+        fprintf(stderr, "test: '%s': unary operator expected\n", args[0]);
+        return 2;
+    }
+    int pos = 0;
+    result = test_or(args, n, &pos);
+    if (result != 2 && pos < n) {
+        fprintf(stderr, "test: extra argument '%s'\n", args[pos]);
+        return 2;
+    }
+    return result;
 }
 
-void set_variable(char *name, char *value, int global) {
-    for (int i = 0; i < MAX_VARS; i++) {
-        if (variables[i].name != NULL && strcmp(variables[i].name, name) == 0) {
-            free(variables[i].value);
-            variables[i].value = strdup(value);
-            return;
+int test_or(char **args, int n, int *pos) {
+    int result = 1;
+    int any = 0, all = 1; // of -o and -a terms respectively
+    while (1) {
+        int negate = 0;
+        while (*pos < n && strcmp(args[*pos], "!") == 0) {
+            negate = !negate;
+            (*pos)++;
         }
-        if (variables[i].name == NULL) {
-            variables[i].name = strdup(name);
-            variables[i].value = strdup(value);
-            variables[i].global = global;
-            return;
+        result = test_primary(args, n, pos);
+        if (result == 2) {
+            return 2;
+        }
+        if (negate)
+            result = !result;
+        all = all && result == 0;
+        if (*pos < n && strcmp(args[*pos], "-a") == 0) {
+            (*pos)++;
+            continue;
         }
+        any = any || all;
+        all = 1;
+        if (*pos < n && strcmp(args[*pos], "-o") == 0) {
+            (*pos)++;
+            continue;
+        }
+        return any ? 0 : 1;
     }
-    printf("Error: Maximum number of variables reached\n");
 }
 
-char *get_variable(char *name) {
-    for (int i = 0; i < MAX_VARS; i++) {
-        if (variables[i].name != NULL && strcmp(variables[i].name, name) == 0) {
-            return variables[i].value;
+int test_primary(char **args, int n, int *pos) {
+    if (*pos >= n) {
+        fprintf(stderr, "test: argument expected\n");
+        return 2;
+    }
+    char *arg = args[*pos];
+    if (strcmp(arg, "(") == 0) {
+        (*pos)++;
+        int result = test_or(args, n, pos);
+        if (result != 2 && (*pos >= n || strcmp(args[*pos], ")") != 0)) {
+            fprintf(stderr, "test: ')' expected\n");
+            return 2;
         }
+        (*pos)++;
+        return result;
     }
-    return NULL; // Variable not found
+    if (*pos + 2 < n && is_test_binary(args[*pos + 1])) {
+        *pos += 3;
+        return test_binary(arg, args[*pos - 2], args[*pos - 1]);
+    }
+    if (is_test_unary(arg) && *pos + 1 < n) {
+        *pos += 2;
+        return test_unary(arg, args[*pos - 1]);
+    }
+    (*pos)++;
+    return arg[0] == '\0';
 }
 
-void list_variables() {
-    printf("User-defined variables:\n");
-    for (int i = 0; i < MAX_VARS; i++) {
-        if (variables[i].name != NULL) {
-            printf("  %s = %s (%s)\n", variables[i].name, variables[i].value, 
-                variables[i].global ? "global" : "local");
+int is_test_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghLknprsStuwxOGz", op[1]) != NULL;
+}
+
+int is_test_binary(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                 "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int test_unary(const char *op, const char *arg) {
+    struct stat st;
+    int ok;
+    switch (op[1]) {
+    case 'n': return arg[0] == '\0';
+    case 'z': return arg[0] != '\0';
+    case 't': return !isatty(atoi(arg));
+    case 'r': return access(arg, R_OK) != 0;
+    case 'w': return access(arg, W_OK) != 0;
+    case 'x': return access(arg, X_OK) != 0;
+    case 'h':
+    case 'L': return !(lstat(arg, &st) == 0 && S_ISLNK(st.st_mode));
+    }
+    if (stat(arg, &st) != 0) {
+        return 1;
+    }
+    switch (op[1]) {
+    case 'b': ok = S_ISBLK(st.st_mode); break;
+    case 'c': ok = S_ISCHR(st.st_mode); break;
+    case 'd': ok = S_ISDIR(st.st_mode); break;
+    case 'f': ok = S_ISREG(st.st_mode); break;
+    case 'p': ok = S_ISFIFO(st.st_mode); break;
+    case 'S': ok = S_ISSOCK(st.st_mode); break;
+    case 's': ok = st.st_size > 0; break;
+    case 'g': ok = (st.st_mode & S_ISGID) != 0; break;
+    case 'u': ok = (st.st_mode & S_ISUID) != 0; break;
+    case 'k': ok = (st.st_mode & S_ISVTX) != 0; break;
+    case 'O': ok = st.st_uid == geteuid(); break;
+    case 'G': ok = st.st_gid == getegid(); break;
+    default: ok = 1; break; // -e
+    }
+    return !ok;
+}
+
+int test_binary(const char *left, const char *op, const char *right) {
+    if (op[0] != '-') {
+        int c = strcmp(left, right);
+        if (op[0] == '<')
+            return !(c < 0);
+        if (op[0] == '>')
+            return !(c > 0);
+        return op[0] == '!' ? c == 0 : c != 0;
+    }
+    if (op[1] == 'n' && op[2] == 't') {
+        struct stat a, b;
+        int has_a = stat(left, &a) == 0, has_b = stat(right, &b) == 0;
+        return !(has_a && (!has_b || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                           (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec)));
+    }
+    if (op[1] == 'o' && op[2] == 't') {
+        return test_binary(right, "-nt", left);
+    }
+    if (op[1] == 'e' && op[2] == 'f') {
+        struct stat a, b;
+        return !(stat(left, &a) == 0 && stat(right, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+    }
+    long long a = test_integer(left), b = test_integer(right);
+    if (last_status == 2) {
+        return 2;
+    }
+    int ok;
+    if (strcmp(op, "-eq") == 0)
+        ok = a == b;
+    else if (strcmp(op, "-ne") == 0)
+        ok = a != b;
+    else if (strcmp(op, "-lt") == 0)
+        ok = a < b;
+    else if (strcmp(op, "-le") == 0)
+        ok = a <= b;
+    else if (strcmp(op, "-gt") == 0)
+        ok = a > b;
+    else
+        ok = a >= b;
+    return !ok;
+}
+
+// An integer operand; an invalid one sets last_status to 2
+long long test_integer(const char *s) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end))
+        end++;
+    if (end == s || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "test: invalid integer '%s'\n", s);
+        last_status = 2;
+    }
+    return value;
+}
+
+// printf FORMAT [arg...]: the format is reused while arguments remain
+void builtin_printf(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: printf FORMAT [ARGUMENT]...\n");
+        last_status = 1;
+        return;
+    }
+    char **args = &arglist[2];
+    while (1) {
+        int used = 0;
+        if (printf_format(arglist[1], &args, &used) == NULL) {
+            break; // \c in a %b argument
         }
+        if (*args == NULL || used == 0) {
+            break;
+        }
+    }
+    check_output("printf");
+}
+
+// One pass over fmt, taking arguments from *args. Returns NULL if output
+// must stop.
+const char *printf_format(const char *fmt, char ***args, int *used) {
+    for (const char *p = fmt; *p; p++) {
+        if (*p == '\\') {
+            // Reuse the escape printer on a single escape sequence
+            char esc[8] = "\\";
+            int n = 1;
+            p++;
+            if (*p == '\0') {
+                putchar('\\');
+                break;
+            }
+            esc[n++] = *p;
+            if (*p == 'x') {
+                while (n < 4 && isxdigit((unsigned char)p[1]))
+                    esc[n++] = *++p;
+            } else if (*p >= '0' && *p <= '7') {
+                while (n < 4 && p[1] >= '0' && p[1] <= '7')
+                    esc[n++] = *++p;
+            }
+            esc[n] = '\0';
+            if (strcmp(esc, "\\c") == 0) {
+                return NULL;
+            }
+            print_escaped(esc, 0);
+            continue;
+        }
+        if (*p != '%') {
+            putchar(*p);
+            continue;
+        }
+        if (p[1] == '%') {
+            putchar('%');
+            p++;
+            continue;
+        }
+
+        // Copy the directive, resolving * width and precision
+        char spec[64];
+        int n = 0;
+        spec[n++] = '%';
+        p++;
+        while (*p && strchr("-+ #0'", *p) && n < 20)
+            spec[n++] = *p++;
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*p != '.')
+                    break;
+                spec[n++] = *p++;
+            }
+            if (*p == '*') {
+                n += snprintf(spec + n, 16, "%d", **args ? atoi(*(*args)++) : 0);
+                (*used)++;
+                p++;
+            } else {
+                while (isdigit((unsigned char)*p) && n < 40)
+                    spec[n++] = *p++;
+            }
+        }
+        char conv = *p;
+        if (conv == '\0' || strchr("diouxXfFeEgGaAcsb", conv) == NULL) {
+            fprintf(stderr, "printf: %%%c: invalid conversion specification\n", conv ? conv : ' ');
+            last_status = 1;
+            return NULL;
+        }
+        char *arg = **args ? *(*args)++ : NULL;
+        if (arg != NULL)
+            (*used)++;
+
+        if (conv == 'b') {
+            // %b: escapes in the argument; \c stops all output
+            if (arg != NULL && print_escaped(arg, 1))
+                return NULL;
+            continue;
+        }
+        if (conv == 's' || conv == 'c') {
+            spec[n++] = conv;
+            spec[n] = '\0';
+            if (conv == 'c')
+                printf(spec, arg ? arg[0] : '\0');
+            else
+                printf(spec, arg ? arg : "");
+            continue;
+        }
+
+        // Numbers: 'c or "c gives the character's value
+        int is_float = strchr("feEgGaAF", conv) != NULL;
+        int is_char = arg != NULL && (arg[0] == '\'' || arg[0] == '"');
+        long double real = 0;
+        long long value = 0;
+        char *end = "";
+        errno = 0;
+        if (is_char)
+            value = (unsigned char)arg[1], real = value;
+        else if (arg != NULL && is_float)
+            real = strtold(arg, &end);
+        else if (arg != NULL && (conv == 'd' || conv == 'i'))
+            value = strtoll(arg, &end, 0);
+        else if (arg != NULL)
+            value = (long long)strtoull(arg, &end, 0);
+        if (arg != NULL && !is_char && (*end != '\0' || end == arg || errno == ERANGE)) {
+            fflush(stdout);
+            fprintf(stderr, "printf: '%s': %s\n", arg,
+                    errno == ERANGE ? "Numerical result out of range"
+                    : end == arg    ? "expected a numeric value"
+                                    : "value not completely converted");
+            last_status = 1;
+        }
+        if (is_float) {
+            strcpy(spec + n, (char[]){ 'L', conv, '\0' });
+            printf(spec, real);
+        } else {
+            strcpy(spec + n, (char[]){ 'l', 'l', conv, '\0' });
+            printf(spec, value);
+        }
+    }
+    return fmt;
+}
+
+// Map the history file of earlier sessions; lines of this session are
+// appended to it as they are entered
+void open_history() {
+    char *file = lookup_variable("HISTFILE");
+    char path[4096];
+    if (file == NULL) {
+        char *home = getenv("HOME");
+        if (home == NULL) {
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/%s", home, HIST_FILE);
+        file = path;
+    }
+    hist_fd = high_fd(open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+    if (hist_fd < 0) {
+        perror(file);
+        return;
+    }
+    struct stat st;
+    if (fstat(hist_fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist_fd, 0);
+        if (map != MAP_FAILED) {
+            hist_map = map;
+            hist_map_size = st.st_size;
+        }
+    }
+}
+
+// Build the line table for the mapped file. Session lines added before
+// this ran are moved behind the file's.
+void index_history() {
+    if (hist_indexed) {
+        return;
+    }
+    hist_indexed = 1;
+    long file_lines = 0;
+    for (const char *p = hist_map, *end = hist_map + hist_map_size; p < end; file_lines++) {
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+
+    long session = hist_count;
+    hist_capacity = file_lines + session + 1024;
+    HistEntry *entries = malloc(hist_capacity * sizeof(HistEntry));
+    long n = 0;
+    int escaped = hist_map_size > 0 && memchr(hist_map, HIST_ESC, hist_map_size) != NULL;
+    for (const char *p = hist_map, *end = hist_map + hist_map_size; p < end; n++) {
+        const char *nl = memchr(p, '\n', end - p);
+        entries[n].text = p;
+        entries[n].len = (nl ? nl : end) - p;
+        if (escaped && memchr(p, HIST_ESC, entries[n].len) != NULL)
+            history_decode(&entries[n]);
+        p = nl ? nl + 1 : end;
+    }
+    if (session > 0) {
+        memcpy(entries + n, hist_entries, session * sizeof(HistEntry));
+    }
+    free(hist_entries);
+    hist_entries = entries;
+    hist_count = file_lines + session;
+}
+
+// Copy a file line with its HIST_ESC escapes undone into hist_arena
+void history_decode(HistEntry *e) {
+    char *text = arena_alloc(&hist_arena, e->len + 1), *o = text;
+    for (size_t i = 0; i < e->len; i++) {
+        if (e->text[i] == HIST_ESC && i + 1 < e->len) {
+            i++;
+            *o++ = e->text[i] == 'n' ? '\n' : e->text[i];
+        } else {
+            *o++ = e->text[i];
+        }
+    }
+    *o = '\n';
+    e->text = text;
+    e->len = o - text;
+}
+
+// Add to command history. Scripts, -c and piped input keep none: nothing
+// would read it back, and it would grow with every command run.
+void add_to_history(char *cmdline) {
+    if (!interactive) {
+        return;
+    }
+    size_t len = strlen(cmdline);
+    if (strspn(cmdline, " \t") == len) {
+        return; // Blank lines are not remembered
+    }
+    if (hist_count == hist_capacity) {
+        hist_capacity = hist_capacity ? hist_capacity * 2 : 1024;
+        hist_entries = realloc(hist_entries, hist_capacity * sizeof(HistEntry));
+    }
+    char *text = arena_alloc(&hist_arena, len + 1);
+    memcpy(text, cmdline, len);
+    text[len] = '\n';
+    hist_entries[hist_count].text = text;
+    hist_entries[hist_count].len = len;
+    hist_count++;
+    if (grams_indexed > 0) {
+        index_entry(hist_count);
+    }
+
+    // One line per entry in the file: newlines inside it (a here-document,
+    // a quoted newline) are escaped. A single O_APPEND write keeps lines
+    // whole when several shells share the file.
+    char *record = text;
+    size_t record_len = len + 1;
+    if (memchr(cmdline, '\n', len) != NULL || memchr(cmdline, HIST_ESC, len) != NULL) {
+        record = arena_alloc(&cmd_arena, 2 * len + 1);
+        record_len = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (cmdline[i] == '\n' || cmdline[i] == HIST_ESC) {
+                record[record_len++] = HIST_ESC;
+                record[record_len++] = cmdline[i] == '\n' ? 'n' : HIST_ESC;
+            } else {
+                record[record_len++] = cmdline[i];
+            }
+        }
+        record[record_len++] = '\n';
+    }
+    if (hist_fd >= 0 && write(hist_fd, record, record_len) < 0) {
+        perror("history");
+        close(hist_fd);
+        hist_fd = -1;
+    }
+}
+
+// Entry n (1-based) copied into cmd_arena, or NULL if there is none
+char *history_line(long n) {
+    index_history();
+    if (n < 1 || n > hist_count) {
+        return NULL;
+    }
+    HistEntry *e = &hist_entries[n - 1];
+    char *line = arena_alloc(&cmd_arena, e->len + 1);
+    memcpy(line, e->text, e->len);
+    line[e->len] = '\0';
+    return line;
+}
+
+void show_history(char *arglist[]) {
+    index_history();
+    if (arglist[1] != NULL && strcmp(arglist[1], "search") == 0) {
+        int prefix = arglist[2] != NULL && strcmp(arglist[2], "-p") == 0;
+        if (arglist[2 + prefix] == NULL) {
+            fprintf(stderr, "Usage: history search [-p] <text>\n");
+            return;
+        }
+        // The words after search form one pattern
+        size_t len = 0;
+        for (int i = 2 + prefix; arglist[i] != NULL; i++) {
+            len += strlen(arglist[i]) + 1;
+        }
+        char *pat = arena_alloc(&cmd_arena, len);
+        pat[0] = '\0';
+        for (int i = 2 + prefix; arglist[i] != NULL; i++) {
+            if (i > 2 + prefix) {
+                strcat(pat, " ");
+            }
+            strcat(pat, arglist[i]);
+        }
+        search_history(pat, prefix);
+        return;
+    }
+    long first = 1;
+    if (arglist[1] != NULL && atol(arglist[1]) > 0 && atol(arglist[1]) < hist_count) {
+        first = hist_count - atol(arglist[1]) + 1;
+    }
+    for (long n = first; n <= hist_count; n++) {
+        HistEntry *e = &hist_entries[n - 1];
+        printf("%5ld  %.*s\n", n, (int)e->len, e->text);
+    }
+}
+
+// Repeat a command from history: !n is entry n, !-n the n-th most recent
+// and !! the last one; !prefix is the latest line starting with prefix and
+// !?text? the latest containing text. The repeated line is itself added to
+// history.
+void repeat_command(char *cmdline) {
+    long cmd_num;
+    index_history();
+    if (strcmp(cmdline, "!!") == 0) {
+        cmd_num = -1;
+    } else if (cmdline[1] == '?') {
+        char *end = strchr(cmdline + 2, '?');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        cmd_num = cmdline[2] ? history_find(cmdline + 2, 0) : 0;
+        if (cmd_num == 0) {
+            fprintf(stderr, "No command found containing '%s'\n", cmdline + 2);
+            return;
+        }
+    } else if (cmdline[1] != '-' && !isdigit((unsigned char)cmdline[1])) {
+        cmdline[strcspn(cmdline, " \t")] = '\0';
+        cmd_num = cmdline[1] ? history_find(cmdline + 1, 1) : 0;
+        if (cmd_num == 0) {
+            fprintf(stderr, "No command found starting with '%s'\n", cmdline + 1);
+            return;
+        }
+    } else if (sscanf(cmdline + 1, "%ld", &cmd_num) != 1 || cmd_num == 0) {
+        fprintf(stderr, "Invalid command number\n");
+        return;
+    }
+
+    if (cmd_num < 0) {
+        cmd_num = hist_count + cmd_num + 1;
+    }
+    char *line = history_line(cmd_num);
+    if (line == NULL) {
+        fprintf(stderr, "No command found for that number\n");
+        return;
+    }
+    printf("%s\n", line);
+    fflush(stdout);
+    add_to_history(line);
+    run_line(line);
+}
+
+// Run a pipeline of any length. Every stage is started before the shell
+// waits for any of them, so a stage never blocks on a full pipe whose
+// reader has not been started yet. $? keeps the previous status until
+// the words, redirection targets and here-documents have been expanded.
+int run_pipeline(Pipeline *p) {
+    int nstages = p->ncmds;
+    int background = p->background;
+
+    if (nstages == 1 && !background && p->cmds[0].type != CMD_SIMPLE) {
+        run_builtin(NULL, &p->cmds[0], NULL);
+        return 0;
+    }
+    char **words[nstages]; // NULL for a compound command
+    for (int k = 0; k < nstages; k++)
+        words[k] = p->cmds[k].type == CMD_SIMPLE ? command_words(&p->cmds[k]) : NULL;
+    char **arglist = words[0];
+    Builtin *b = arglist == NULL ? NULL
+                 : p->cmds[0].expand && arglist[0] != NULL ? find_builtin(arglist[0]) : p->cmds[0].builtin;
+    if (b != NULL && (b->flags & BUILTIN_WHOLE_LINE)) {
+        Pipeline *outer = whole_line;
+        whole_line = p;
+        last_status = 0;
+        b->fn(arglist);
+        whole_line = outer;
+        return 0;
+    }
+
+    if (nstages == 1 && arglist != NULL && arglist[0] == NULL) {
+        // Only redirections: files are created or checked, nothing runs
+        FdMove moves[p->cmds[0].nredirs + 1];
+        int nmoves = 0;
+        if (open_redirects(&p->cmds[0], moves, &nmoves) == 0) {
+            close_moves(moves, nmoves);
+            last_status = 0;
+        }
+        return 0;
+    }
+
+    if (b != NULL && nstages == 1 && !background && !(b->flags & BUILTIN_PIPE_ONLY)) {
+        run_builtin(b, &p->cmds[0], arglist);
+        return 0;
+    }
+
+    pid_t *pids = arena_alloc(&cmd_arena, nstages * sizeof(pid_t));
+    pid_t pgid = job_control ? 0 : -1; // The first stage leads the group
+    char *pipesize = get_variable("PIPESIZE"); // Optional F_SETPIPE_SZ for each pipe
+    int prev_read = -1; // Read end of the pipe from the previous stage
+    int launched = 0;
+    pid_t last_pid = -1; // Its status becomes the pipeline's
+    long long started = now_ns(); // Before the first stage, so its run time counts
+    for (int k = 0; k < nstages; k++) {
+        Command *cmd = &p->cmds[k];
+        char **stage = words[k];
+        int last = (k == nstages - 1);
+
+        int pipefd[2] = { -1, -1 };
+        if (!last && pipe2(pipefd, O_CLOEXEC) < 0) {
+            perror("Pipe failed");
+            break;
+        }
+        if (!last && pipesize != NULL && fcntl(pipefd[1], F_SETPIPE_SZ, atoi(pipesize)) < 0) {
+            perror("PIPESIZE");
+        }
+
+        // The pipes come first and redirections after them, so `2>&1`
+        // joins stdout wherever it goes. Files are opened here so errors
+        // are reported before the stage is started; launch() wires
+        // everything up in the child.
+        FdMove moves[cmd->nredirs + 2];
+        int nmoves = 0;
+        if (prev_read != -1)
+            moves[nmoves++] = (FdMove){ STDIN_FILENO, prev_read, 0 };
+        if (pipefd[1] != -1)
+            moves[nmoves++] = (FdMove){ STDOUT_FILENO, pipefd[1], 0 };
+        if (open_redirects(cmd, moves, &nmoves) == 0) {
+            b = stage != NULL ? find_stage_builtin(stage, nstages) : NULL;
+            if (stage == NULL) {
+                pids[launched] = launch_compound(cmd, moves, nmoves, pgid, !background);
+            } else if (b != NULL) {
+                pids[launched] = launch_builtin(b, stage, moves, nmoves, pgid, !background);
+            } else {
+                pids[launched] = launch(stage, moves, nmoves, pgid, !background);
+            }
+            if (pids[launched] > 0) {
+                if (pgid == 0)
+                    pgid = pids[launched];
+                if (last)
+                    last_pid = pids[launched];
+                launched++;
+            } else {
+                last_status = 127;
+            }
+            close_moves(moves, nmoves);
+        }
+        if (prev_read != -1)
+            close(prev_read);
+        if (pipefd[1] != -1)
+            close(pipefd[1]);
+        prev_read = pipefd[0];
+    }
+    if (prev_read != -1)
+        close(prev_read);
+
+    if (launched == 0) {
+        return 1; // launch() or open_redirects() already reported why
+    }
+
+    Job *job = add_job(pids, launched, pgid > 0 ? pgid : 0, p->text, started);
+    if (last_pid < 0) {
+        job->pid = -1; // The last stage never started: the pipeline fails
+        job->status = 127 << 8;
+    }
+    if (background) {
+        last_status = 0;
+        if (interactive) {
+            printf("Started background process with PID %d\n", pids[launched - 1]);
+        }
+    } else {
+        job->foreground = 1;
+        wait_foreground(job);
+    }
+    return 0;
+}
+
+// Open what the redirections of cmd name and add them to moves, in
+// order. n>&m is checked against the moves before it. On failure nothing
+// new is left open and -1 is returned.
+int open_redirects(Command *cmd, FdMove *moves, int *nmoves) {
+    int first = *nmoves;
+    for (int i = 0; i < cmd->nredirs; i++) {
+        Redirect *r = &cmd->redirs[i];
+        char *target = r->expand ? expand_word(r->target) : r->target;
+        int fd;
+        if (r->op == REDIR_DUP) {
+            fd = target[0] == '-' ? -1 : target[0] - '0';
+            if (fd != -1 && !fd_is_open(moves, *nmoves, fd)) {
+                fprintf(stderr, "%d: Bad file descriptor\n", fd);
+                close_moves(moves + first, *nmoves - first);
+                last_status = 1;
+                return -1;
+            }
+            moves[(*nmoves)++] = (FdMove){ r->fd, fd, 0 };
+            continue;
+        }
+        if (r->op == REDIR_IN) {
+            fd = open(target, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                perror("Failed to open file for reading");
+        } else if (r->op == REDIR_HEREDOC) {
+            fd = heredoc_fd(target);
+        } else {
+            int mode = r->op == REDIR_APPEND ? O_APPEND : O_TRUNC;
+            fd = open(target, O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0644);
+            if (fd < 0)
+                perror("Failed to open file for writing");
+        }
+        if (fd < 0) {
+            close_moves(moves + first, *nmoves - first);
+            last_status = 1;
+            return -1;
+        }
+        moves[(*nmoves)++] = (FdMove){ r->fd, high_fd(fd), 1 };
+    }
+    return 0;
+}
+
+// Whether fd is open once moves are done
+int fd_is_open(FdMove *moves, int nmoves, int fd) {
+    for (int i = nmoves - 1; i >= 0; i--) {
+        if (moves[i].fd == fd)
+            return moves[i].from != -1;
+    }
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+// A descriptor reading text, for <<, <<- and <<<. The text goes to a
+// memfd: it never touches the filesystem, and unlike a pipe any size fits
+// without a reader running yet.
+int heredoc_fd(const char *text) {
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("here-document");
+        return -1;
+    }
+    size_t len = strlen(text), done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("here-document");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Move fd to FD_HIGH or above, out of the range redirections can name,
+// so that `3>file` never replaces a descriptor the shell still needs
+int high_fd(int fd) {
+    if (fd < 0 || fd >= FD_HIGH) {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, FD_HIGH);
+    close(fd);
+    return high;
+}
+
+// In a forked child: set up the stage's descriptors
+void apply_moves(FdMove *moves, int nmoves) {
+    for (int i = 0; i < nmoves; i++) {
+        if (moves[i].from == -1)
+            close(moves[i].fd);
+        else if (moves[i].from != moves[i].fd)
+            dup2(moves[i].from, moves[i].fd);
+    }
+}
+
+void close_moves(FdMove *moves, int nmoves) {
+    for (int i = 0; i < nmoves; i++) {
+        if (moves[i].owned)
+            close(moves[i].from);
+    }
+}
+
+// Start one stage, arglist with its descriptors set up by moves. pgid is
+// -1 without job control, 0 to lead a new process group or the group to
+// join; a foreground stage takes the terminal before it runs. posix_spawn
+// runs the child with vfork semantics, so unlike fork() the cost does not
+// grow with the size of the shell's heap; fork() is kept for -F.
+pid_t launch(char *arglist[], FdMove *moves, int nmoves, pid_t pgid, int foreground) {
+    pid_t pid;
+    char *path = find_command(arglist[0]);
+    if (path == NULL) {
+        fprintf(stderr, "Command not found...: %s\n", arglist[0]);
+        return -1;
+    }
+    fflush(stdout); // Builtin output written so far goes out before the child's
+
+    if (use_fork) {
+        pid = fork();
+        if (pid < 0) {
+            perror("Fork failed");
+            return -1;
+        }
+        if (pid == 0) {
+            child_job_setup(pgid, foreground);
+            apply_moves(moves, nmoves);
+            execve(path, arglist, exec_env());
+            perror("Command not found...");
+            _exit(127);
+        }
+        if (pgid >= 0)
+            setpgid(pid, pgid ? pgid : pid); // Also in the parent, so neither side races
+        return pid;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short flags = 0;
+    if (pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+#if __GLIBC_PREREQ(2, 35)
+        // Done in the child with signals blocked, before anything can read
+        if (foreground)
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+    }
+    if (job_control) {
+        flags |= POSIX_SPAWN_SETSIGDEF;
+        posix_spawnattr_setsigdefault(&attr, &job_signals);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    for (int i = 0; i < nmoves; i++) {
+        if (moves[i].from == -1)
+            posix_spawn_file_actions_addclose(&actions, moves[i].fd);
+        else if (moves[i].from != moves[i].fd)
+            posix_spawn_file_actions_adddup2(&actions, moves[i].from, moves[i].fd);
+    }
+    char **envp = exec_env();
+    int err = posix_spawn(&pid, path, &actions, &attr, arglist, envp);
+    if (err == ENOENT && path != arglist[0]) {
+        // The cached location went away; search PATH again once
+        forget_command(arglist[0]);
+        path = find_command(arglist[0]);
+        err = path ? posix_spawn(&pid, path, &actions, &attr, arglist, envp) : ENOENT;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        perror("Command not found...");
+        return -1;
+    }
+    return pid;
+}
+
+void sigchld_handler(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    child_exited = 1;
+    write(sigchld_pipe[1], "", 1); // Wakes poll() in wait_for_input()
+    errno = saved_errno;
+}
+
+void sigwinch_handler(int signo) {
+    (void)signo;
+    window_changed = 1;
+}
+
+// Ctrl-C while the shell itself runs a loop of builtins
+void sigint_handler(int signo) {
+    (void)signo;
+    interrupted = 1;
+}
+
+// Collect every finished background child. Runs in the main loop, so it
+// cannot race with run_pipeline() adding jobs or waiting for a foreground one.
+void reap_children() {
+    char drain[64];
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    child_exited = 0;
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        Job *job = find_job_by_pid(pid);
+        if (job == NULL) {
+            continue;
+        }
+        if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+            if (WIFSTOPPED(status) && !job->stopped && interactive) {
+                printf("\n[%d]+  Stopped                 %s\n", job->job_number, job->command);
+            }
+            job->stopped = WIFSTOPPED(status);
+            continue;
+        }
+        if (job_stage_done(job, pid, status, &usage)) {
+            if (interactive) {
+                printf("Job with PID %d terminated.\n", job->pid); // Message when job is terminated
+            }
+            remove_job(job);
+        }
+    }
+}
+
+// Block until fd is readable, reaping children whenever SIGCHLD arrives
+// in the meantime. Returns -1 on a poll() error.
+int wait_for_input(int fd) {
+    struct pollfd fds[2] = {
+        { fd, POLLIN, 0 },
+        { sigchld_pipe[0], POLLIN, 0 },
+    };
+    while (1) {
+        if (child_exited) {
+            reap_children();
+            fflush(stdout);
+        }
+        if (poll(fds, sigchld_pipe[0] >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (fds[0].revents != 0) {
+            return 0;
+        }
+    }
+}
+
+// The returned line stays valid until the next call
+char *read_cmd(const char *prompt) {
+    if (line_editing) {
+        fflush(stdout);
+        return edit_line(prompt);
+    }
+    if (interactive) {
+        printf("%s", prompt);
+    }
+    fflush(stdout); // Prompt and builtin output go out before the next child writes
+    return reader_getline(&input); // NULL on EOF
+}
+
+void change_directory(char *path) {
+    if (path == NULL || chdir(path) != 0) {
+        perror("cd failed");
+        return;
+    }
+    clear_dir_listings(); // Relative listings belong to the old directory
+}
+
+void show_jobs() {
+    for (int i = 0; i < job_high; i++) {
+        if (jobs[i].pid != 0) {
+            printf("[%d] %d %s  %s\n", jobs[i].job_number, jobs[i].pid,
+                   jobs[i].stopped ? "Stopped" : "Running", jobs[i].command);
+        }
+    }
+}
+
+// kill [-SIGNAL] %job|pid. A job's whole process group is signalled, so
+// every stage of a pipeline gets it; the default is SIGKILL.
+void kill_command(char *arglist[]) {
+    static const struct { const char *name; int sig; } names[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+        { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { NULL, 0 }
+    };
+    int sig = SIGKILL;
+    char **arg = &arglist[1];
+    if (*arg != NULL && (*arg)[0] == '-') {
+        char *name = *arg + 1;
+        if (strncmp(name, "SIG", 3) == 0)
+            name += 3;
+        sig = isdigit((unsigned char)name[0]) ? atoi(name) : 0;
+        for (int i = 0; names[i].name != NULL && sig == 0; i++) {
+            if (strcmp(names[i].name, name) == 0)
+                sig = names[i].sig;
+        }
+        if (sig <= 0) {
+            fprintf(stderr, "kill: unknown signal %s\n", *arg);
+            last_status = 1;
+            return;
+        }
+        arg++;
+    }
+    if (*arg == NULL) {
+        fprintf(stderr, "Usage: kill [-SIGNAL] <%%job_number or pid>\n");
+        last_status = 2;
+        return;
+    }
+    if ((*arg)[0] == '%') {
+        kill_job(atoi(*arg + 1), sig);
+    } else {
+        kill_job_by_pid(atoi(*arg), sig);
+    }
+}
+
+void kill_job(int job_number, int sig) {
+    Job *job = find_job(job_number);
+    if (job != NULL) {
+        pid_t target = job->pgid > 0 ? -job->pgid : job->pid;
+        if (kill(target, sig) == 0) {
+            if (job->stopped && sig != SIGKILL && sig != SIGCONT && sig != SIGSTOP) {
+                kill(target, SIGCONT); // A stopped job only sees the signal once resumed
+            }
+            if (sig == SIGKILL) {
+                printf("Killed job [%d] with PID %d: %s\n", job_number, job->pid, job->command);
+            } else {
+                printf("Sent %s to job [%d]: %s\n", strsignal(sig), job_number, job->command);
+            }
+        } else {
+            perror("Failed to kill job");
+            last_status = 1;
+        }
+    } else {
+        fprintf(stderr, "No such job number\n");
+        last_status = 1;
+    }
+}
+
+void kill_job_by_pid(int pid, int sig) {
+    if (pid > 0 && kill(pid, sig) == 0) {
+        if (sig == SIGKILL) {
+            printf("Killed job with PID %d\n", pid);
+        } else {
+            printf("Sent %s to PID %d\n", strsignal(sig), pid);
+        }
+    } else {
+        perror("Failed to kill job by PID");
+        last_status = 1;
+    }
+}
+
+// Give a new job the lowest-cost free job number: a released one if any,
+// otherwise the next new one. started is when its first process was launched.
+Job *add_job(int *pids, int npids, int pgid, char *command, long long started) {
+    int job_number;
+    if (free_count > 0) {
+        job_number = free_jobs[--free_count];
+    } else {
+        if (job_high == job_capacity) {
+            job_capacity = job_capacity ? job_capacity * 2 : 16;
+            jobs = realloc(jobs, job_capacity * sizeof(Job));
+            free_jobs = realloc(free_jobs, job_capacity * sizeof(int));
+        }
+        job_number = ++job_high;
+    }
+    Job *job = &jobs[job_number - 1];
+    job->pid = pids[npids - 1];
+    job->job_number = job_number;
+    job->command = strdup(command);
+    job->started = started;
+    job->batch = 0;
+    job->pgid = pgid;
+    job->pids = malloc(npids * sizeof(int));
+    memcpy(job->pids, pids, npids * sizeof(int));
+    job->npids = job->live = npids;
+    job->status = 0;
+    job->stopped = 0;
+    job->foreground = 0;
+    job->tmodes = cooked_termios;
+    for (int i = 0; i < npids; i++) {
+        pid_map_put(pids[i], job_number);
+    }
+    job_count++;
+    return job;
+}
+
+Job *find_job(int job_number) {
+    if (job_number < 1 || job_number > job_high || jobs[job_number - 1].pid == 0) {
+        return NULL;
+    }
+    return &jobs[job_number - 1];
+}
+
+Job *find_job_by_pid(int pid) {
+    if (pid_capacity == 0) {
+        return NULL;
+    }
+    for (int i = (unsigned int)pid % pid_capacity; pid_keys[i] != 0; i = (i + 1) % pid_capacity) {
+        if (pid_keys[i] == pid) {
+            return &jobs[pid_jobs[i] - 1];
+        }
+    }
+    return NULL;
+}
+
+// Release a job's number. Stages that were not reaped are forgotten.
+void remove_job(Job *job) {
+    for (int i = 0; i < job->npids; i++) {
+        pid_map_delete(job->pids[i]);
+    }
+    free(job->pids);
+    free(job->command);
+    job->pid = 0;
+    job->pids = NULL;
+    job->command = NULL;
+    free_jobs[free_count++] = job->job_number;
+    job_count--;
+}
+
+// Account for one reaped stage; returns 1 once the whole job has ended
+int job_stage_done(Job *job, int pid, int status, struct rusage *usage) {
+    record_exit(pid, job->foreground ? 0 : job->job_number, job->command, job->started, status, usage);
+    pid_map_delete(pid);
+    if (pid == job->pid) {
+        job->status = status;
+    }
+    return --job->live == 0;
+}
+
+// Wait until a foreground job ends or stops. With job control the job's
+// process group has the terminal meanwhile; the shell takes it back, with
+// its own terminal modes, afterwards.
+void wait_foreground(Job *job) {
+    int status = 0;
+    struct rusage usage;
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    int k = 0;
+    while (job->live > 0) {
+        pid_t pid = job_control ? wait4(-job->pgid, &status, WUNTRACED, &usage)
+                                : wait4(job->pids[k], &status, 0, &usage);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            job->live = 0; // Nothing left to wait for
+            break;
+        }
+        if (WIFSTOPPED(status)) {
+            job->stopped = 1;
+            break;
+        }
+        job_stage_done(job, pid, status, &usage);
+        k++;
+    }
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if (job->stopped)
+            tcgetattr(STDIN_FILENO, &job->tmodes);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked_termios);
+    }
+    if (job->stopped) {
+        job->foreground = 0;
+        last_status = 128 + WSTOPSIG(status);
+        printf("\n[%d]+  Stopped                 %s\n", job->job_number, job->command);
+        return;
+    }
+    status = job->status;
+    last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (job_control && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        interrupted = 1; // Ctrl-C stops the loop or list around the job too
+    }
+    remove_job(job);
+    if (interactive) {
+        printf("Child exited with status %d\n", last_status);
+    }
+}
+
+// The job named by %n or n, or the most recent one
+Job *job_from_arg(char *arg) {
+    if (arg != NULL) {
+        return find_job(atoi(arg[0] == '%' ? arg + 1 : arg));
+    }
+    for (int i = job_high - 1; i >= 0; i--) {
+        if (jobs[i].pid != 0 && !jobs[i].batch) {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// fg [%n]: continue a job in the foreground and wait for it
+void fg_command(char *arglist[]) {
+    Job *job = job_control ? job_from_arg(arglist[1]) : NULL;
+    if (job == NULL) {
+        fprintf(stderr, job_control ? "fg: no such job\n" : "fg: no job control\n");
+        last_status = 1;
+        return;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    job->foreground = 1;
+    if (job->stopped) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        job->stopped = 0;
+    }
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+    kill(-job->pgid, SIGCONT);
+    wait_foreground(job);
+}
+
+// bg [%n]: let a stopped job continue in the background
+void bg_command(char *arglist[]) {
+    Job *job = job_control ? job_from_arg(arglist[1]) : NULL;
+    if (job == NULL) {
+        fprintf(stderr, job_control ? "bg: no such job\n" : "bg: no job control\n");
+        last_status = 1;
+        return;
+    }
+    job->stopped = 0;
+    kill(-job->pgid, SIGCONT);
+    printf("[%d] %s &\n", job->job_number, job->command);
+}
+
+void pid_map_put(int pid, int job_number) {
+    if (2 * (pid_count + 1) > pid_capacity) {
+        // Keep the load under one half; rehash everything into a larger map
+        int old_capacity = pid_capacity;
+        int *old_keys = pid_keys, *old_jobs = pid_jobs;
+        pid_capacity = pid_capacity ? pid_capacity * 2 : 64;
+        pid_keys = calloc(pid_capacity, sizeof(int));
+        pid_jobs = malloc(pid_capacity * sizeof(int));
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_keys[i] != 0) {
+                int j = (unsigned int)old_keys[i] % pid_capacity;
+                while (pid_keys[j] != 0)
+                    j = (j + 1) % pid_capacity;
+                pid_keys[j] = old_keys[i];
+                pid_jobs[j] = old_jobs[i];
+            }
+        }
+        free(old_keys);
+        free(old_jobs);
+    }
+    int i = (unsigned int)pid % pid_capacity;
+    while (pid_keys[i] != 0 && pid_keys[i] != pid)
+        i = (i + 1) % pid_capacity;
+    if (pid_keys[i] == 0)
+        pid_count++;
+    pid_keys[i] = pid;
+    pid_jobs[i] = job_number;
+}
+
+// Linear-probing delete without tombstones: later entries of the same
+// cluster are shifted back into the hole when their probe allows it
+void pid_map_delete(int pid) {
+    if (pid_capacity == 0)
+        return;
+    int i = (unsigned int)pid % pid_capacity;
+    while (pid_keys[i] != pid) {
+        if (pid_keys[i] == 0)
+            return;
+        i = (i + 1) % pid_capacity;
+    }
+    int hole = i;
+    for (int j = (hole + 1) % pid_capacity; pid_keys[j] != 0; j = (j + 1) % pid_capacity) {
+        int home = (unsigned int)pid_keys[j] % pid_capacity;
+        // Move j into the hole unless its home lies cyclically in (hole, j]
+        if ((j > hole && (home <= hole || home > j)) || (j < hole && home <= hole && home > j)) {
+            pid_keys[hole] = pid_keys[j];
+            pid_jobs[hole] = pid_jobs[j];
+            hole = j;
+        }
+    }
+    pid_keys[hole] = 0;
+    pid_count--;
+}
+
+void show_help() {
+    printf("Available commands:\n");
+    printf("  cd <path>            - Change directory\n");
+    printf("  exit                 - Exit shell\n");
+    printf("  jobs                 - Show background jobs\n");
+    printf("  kill [-SIG] %%n       - Signal every process of job n (default SIGKILL)\n");
+    printf("  kill [-SIG] <pid>    - Signal a process by PID\n");
+    printf("  fg [%%n]              - Continue a job in the foreground\n");
+    printf("  bg [%%n]              - Continue a stopped job in the background\n");
+    printf("  help                 - Show this help message\n");
+    printf("  history [n]          - List history (the last n entries)\n");
+    printf("  !n, !-n              - Repeat history entry n, or the n-th most recent\n");
+    printf("  !prefix, !?text?     - Repeat the latest entry starting with prefix or containing text\n");
+    printf("  history search [-p] <text> - List entries containing (-p: starting with) text\n");
+    printf("  set <name> <value>   - Set variable\n");
+    printf("  get <name>           - Get variable value\n");
+    printf("  listvars             - List all variables\n");
+    printf("  unset <name>...      - Remove variables\n");
+    printf("  hash [-r] [name...]  - Show, clear or add remembered command paths\n");
+    printf("  parallel [-j N] cmd [args] ::: item... - Run cmd once per item, N at a time\n");
+    printf("  jobstat              - Show wall/CPU time, max RSS and context switches per job\n");
+    printf("  time <command>       - Run command and report real, user and sys time\n");
+    printf("  bench [-n N] <command> - Run command N times and show a latency histogram\n");
+    printf("  source <file>, . <file> - Run a script in this shell\n");
+    printf("  if list; then list; [elif list; then list;] [else list;] fi\n");
+    printf("  while list; do list; done, until list; do list; done\n");
+    printf("  for name [in word...]; do list; done\n");
+    printf("  break [n], continue [n] - Leave, or start the next iteration of, the n-th loop\n");
+}
+
+void set_variable(char *name, char *value, int global) {
+    if (strcmp(name, "PATH") == 0) {
+        clear_command_hash(); // Remembered locations may no longer be valid
+    }
+    unsigned int hash = hash_string(name);
+    Var *var = find_variable(name, hash);
+    if (var->name == NULL) {
+        if (2 * (var_used + 1) > var_capacity) {
+            grow_variables();
+            var = find_variable(name, hash);
+        }
+        var->name = arena_strdup(&var_names, name);
+        var->hash = hash;
+        var->global = 0;
+        var_used++;
+    }
+    free(var->value);
+    var->value = strdup(value);
+    var->global |= global;
+    if (var->global) {
+        env_dirty = 1;
+    }
+}
+
+char *get_variable(char *name) {
+    if (var_capacity == 0) {
+        return NULL;
+    }
+    return find_variable(name, hash_string(name))->value; // NULL if not found
+}
+
+// Returns 0 if the variable existed
+int unset_variable(char *name) {
+    int found = 0;
+    if (getenv(name) != NULL) {
+        unsetenv(name); // Unset also removes an inherited environment variable
+        env_dirty = 1;
+        found = 1;
+    }
+    Var *var = var_capacity > 0 ? find_variable(name, hash_string(name)) : NULL;
+    if (var != NULL && var->value != NULL) {
+        if (var->global) {
+            env_dirty = 1;
+        }
+        free(var->value);
+        var->value = NULL;
+        var->global = 0;
+        found = 1;
+    }
+    if (found && strcmp(name, "PATH") == 0) {
+        clear_command_hash();
+    }
+    return found ? 0 : -1;
+}
+
+// The slot holding name, or the empty slot where it would be inserted
+Var *find_variable(char *name, unsigned int hash) {
+    if (var_capacity == 0) {
+        grow_variables();
+    }
+    unsigned int i = hash & (var_capacity - 1);
+    while (variables[i].name != NULL) {
+        if (variables[i].hash == hash && strcmp(variables[i].name, name) == 0) {
+            break;
+        }
+        i = (i + 1) & (var_capacity - 1);
+    }
+    return &variables[i];
+}
+
+// Double the table (a power of two), moving every named slot across
+void grow_variables() {
+    int old_capacity = var_capacity;
+    Var *old = variables;
+    var_capacity = var_capacity ? var_capacity * 2 : 64;
+    variables = calloc(var_capacity, sizeof(Var));
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].name != NULL) {
+            unsigned int j = old[i].hash & (var_capacity - 1);
+            while (variables[j].name != NULL)
+                j = (j + 1) & (var_capacity - 1);
+            variables[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// The words of cmd with $NAME, ${NAME} and $? expanded, in cmd_arena.
+// The compiled words are not touched, and an expansion never splits a
+// word in two.
+char **command_words(Command *cmd) {
+    if (!cmd->expand) {
+        return cmd->argv;
+    }
+    char **words = arena_alloc(&cmd_arena, (cmd->argc + 1) * sizeof(char *));
+    for (int i = 0; i < cmd->argc; i++) {
+        char *w = cmd->argv[i];
+        words[i] = strpbrk(w, "$\\") != NULL ? expand_word(w) : w;
+    }
+    words[cmd->argc] = NULL;
+    return words;
+}
+
+int is_name_char(char c, int first) {
+    return c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (!first && c >= '0' && c <= '9');
+}
+
+char *expand_word(char *word) {
+    size_t cap = strlen(word) + 1, len = 0;
+    char *out = malloc(cap);
+    char *p = word;
+    while (*p != '\0') {
+        char *value = NULL; // Stays NULL when p is not an expansion
+        char *end = p;
+        char status[16];
+        if (p[0] == '\\' && p[1] != '\0') {
+            end = ++p; // A quoted character stands for itself
+        } else if (p[0] == '$' && p[1] == '?') {
+            snprintf(status, sizeof(status), "%d", last_status);
+            value = status;
+            end = p + 2;
+        } else if (p[0] == '$' && p[1] == '{' && strchr(p, '}') != NULL) {
+            end = strchr(p, '}');
+            *end = '\0';
+            value = lookup_variable(p + 2);
+            *end++ = '}';
+        } else if (p[0] == '$' && is_name_char(p[1], 1)) {
+            end = p + 2;
+            while (is_name_char(*end, 0))
+                end++;
+            char saved = *end;
+            *end = '\0';
+            value = lookup_variable(p + 1);
+            *end = saved;
+        }
+        if (end == p) {
+            value = p; // Literal character
+            end = p + 1;
+        }
+
+        size_t n = (value == p) ? 1 : (value != NULL ? strlen(value) : 0);
+        if (len + n + 1 > cap) {
+            cap = (len + n + 1) * 2;
+            out = realloc(out, cap);
+        }
+        if (n > 0) {
+            memcpy(out + len, value, n);
+            len += n;
+        }
+        p = end;
+    }
+    out[len] = '\0';
+    char *result = arena_strdup(&cmd_arena, out);
+    free(out);
+    return result;
+}
+
+// Shell variables first, then the inherited environment
+char *lookup_variable(char *name) {
+    char *value = get_variable(name);
+    return value != NULL ? value : getenv(name);
+}
+
+// The environment handed to children: environ with every global variable
+// added or overriding. It is cached and only rebuilt after a global
+// variable changes, not on every launch.
+char **exec_env() {
+    if (!env_dirty) {
+        return shell_env;
+    }
+    arena_reset(&env_arena);
+    int n = 0;
+    while (environ[n] != NULL)
+        n++;
+    shell_env = arena_alloc(&env_arena, (n + var_used + 1) * sizeof(char *));
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        char *eq = strchr(environ[i], '=');
+        if (eq != NULL && var_capacity > 0) {
+            *eq = '\0';
+            Var *var = find_variable(environ[i], hash_string(environ[i]));
+            *eq = '=';
+            if (var->value != NULL && var->global) {
+                continue; // Replaced by the shell's value below
+            }
+        }
+        shell_env[count++] = environ[i];
+    }
+    for (int i = 0; i < var_capacity; i++) {
+        if (variables[i].value != NULL && variables[i].global) {
+            size_t len = strlen(variables[i].name) + strlen(variables[i].value) + 2;
+            char *entry = arena_alloc(&env_arena, len);
+            snprintf(entry, len, "%s=%s", variables[i].name, variables[i].value);
+            shell_env[count++] = entry;
+        }
+    }
+    shell_env[count] = NULL;
+    env_dirty = 0;
+    return shell_env;
+}
+
+void list_variables() {
+    printf("User-defined variables:\n");
+    for (int i = 0; i < var_capacity; i++) {
+        if (variables[i].value != NULL) {
+            printf("  %s = %s (%s)\n", variables[i].name, variables[i].value, 
+                variables[i].global ? "global" : "local");
+        }
+    }
+}
+
+// The builtin to run for a command or pipeline stage, if any. Inside a
+// pipeline, plain `cat` and `tee` run as forked copies of the shell that
+// move data with splice()/tee(), so it never passes through user space;
+// anything with options, or outside a pipeline, is left to the real
+// utilities.
+Builtin *find_stage_builtin(char *arglist[], int nstages) {
+    Builtin *b = find_builtin(arglist[0]);
+    if (b == NULL || !(b->flags & BUILTIN_PIPE_ONLY)) {
+        return b;
+    }
+    if (nstages == 1) {
+        return NULL;
+    }
+    for (int i = 1; arglist[i] != NULL; i++) {
+        if (arglist[i][0] == '-') {
+            return NULL;
+        }
+    }
+    return b;
+}
+
+// Builtins that must run alongside other stages get their own process
+pid_t launch_builtin(Builtin *b, char *arglist[], FdMove *moves, int nmoves, pid_t pgid, int foreground) {
+    pid_t pid = fork_stage(moves, nmoves, pgid, foreground);
+    if (pid == 0) {
+        last_status = 0;
+        b->fn(arglist);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    return pid;
+}
+
+// Fork a copy of the shell to run shell code as a stage: 0 is returned in
+// the child, which has the stage's descriptors, process group and
+// signals, and the pid (or -1) in the parent
+pid_t fork_stage(FdMove *moves, int nmoves, pid_t pgid, int foreground) {
+    fflush(stdout); // Or the child would write the parent's buffered output again
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        child_job_setup(pgid, foreground);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        apply_moves(moves, nmoves);
+        close_moves(moves, nmoves);
+        job_control = 0; // A subshell: no fg/bg or terminal handoff
+        interactive = 0;
+        return 0;
+    }
+    if (pgid >= 0)
+        setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+// In a forked child: join the job's process group, take the terminal for
+// a foreground job (SIGTTOU is still ignored here) and restore the signals
+// the shell ignores
+void child_job_setup(pid_t pgid, int foreground) {
+    if (pgid >= 0) {
+        setpgid(0, pgid);
+        if (foreground)
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    if (job_control) {
+        for (int sig = 1; sig < NSIG; sig++) {
+            if (sigismember(&job_signals, sig) == 1)
+                signal(sig, SIG_DFL);
+        }
+    }
+}
+
+// Copy in_fd to out_fd until EOF. splice() needs a pipe on one side;
+// when neither is a pipe it fails at once and a plain copy is used.
+int copy_fd(int in_fd, int out_fd) {
+    while (1) {
+        ssize_t n = splice(in_fd, NULL, out_fd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                break;
+            }
+            return -1;
+        }
+    }
+
+    char buf[READ_BUF_SIZE];
+    ssize_t n;
+    while ((n = read(in_fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            off += w;
+        }
+    }
+    return 0;
+}
+
+int cat_stage(char *arglist[]) {
+    int status = 0;
+    if (arglist[1] == NULL && copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0) {
+        perror("cat");
+        status = 1;
+    }
+    for (int i = 1; arglist[i] != NULL; i++) {
+        int fd = open(arglist[i], O_RDONLY);
+        if (fd < 0 || copy_fd(fd, STDOUT_FILENO) < 0) {
+            perror(arglist[i]);
+            status = 1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+// Like coreutils tee, an output that cannot be opened or written is
+// reported and dropped; the others still get everything and 1 is returned
+int tee_stage(char *arglist[]) {
+    int status = 0;
+    int nfiles = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        nfiles++;
+    }
+    int fds[nfiles + 1]; // stdout, then the files that opened; -1 once dropped
+    char *names[nfiles + 1];
+    int nout = 0, live;
+    fds[nout] = STDOUT_FILENO;
+    names[nout++] = "tee";
+    for (int i = 1; arglist[i] != NULL; i++) {
+        int fd = open(arglist[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(arglist[i]);
+            status = 1;
+            continue;
+        }
+        fds[nout] = fd;
+        names[nout++] = arglist[i];
+    }
+    if (nout == 1) {
+        if (copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0) {
+            perror("tee");
+            status = 1;
+        }
+        return status;
+    }
+    live = nout;
+
+    // Between two pipes with one file: tee() duplicates the data into
+    // stdout without consuming it, then splice() moves it to the file
+    char buf[READ_BUF_SIZE];
+    int zero_copy = (nout == 2);
+    while (zero_copy) {
+        ssize_t n = tee(STDIN_FILENO, STDOUT_FILENO, SPLICE_CHUNK, 0);
+        if (n == 0) {
+            return status;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EINVAL) { // EINVAL: not both pipes
+                perror("tee");
+                status = 1;
+                fds[0] = -1;
+                live--;
+            }
+            break; // Nothing has been consumed yet
+        }
+        while (n > 0) {
+            ssize_t m = splice(STDIN_FILENO, NULL, fds[1], NULL, n, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                // The file cannot take splice(): write() it the data stdout
+                // already has, which also reports any real error
+                while (n > 0 && (m = read(STDIN_FILENO, buf, n < (ssize_t)sizeof(buf) ? n : (ssize_t)sizeof(buf))) > 0) {
+                    if (fds[1] >= 0 && write(fds[1], buf, m) != m) {
+                        perror(names[1]);
+                        status = 1;
+                        fds[1] = -1;
+                        live--;
+                    }
+                    n -= m;
+                }
+                zero_copy = 0;
+                break;
+            }
+            n -= m;
+        }
+    }
+
+    ssize_t n;
+    while (live > 0 && (n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("tee");
+            return 1;
+        }
+        for (int i = 0; i < nout; i++) {
+            if (fds[i] >= 0 && write(fds[i], buf, n) != n) {
+                perror(names[i]);
+                status = 1;
+                fds[i] = -1;
+                live--;
+            }
+        }
+    }
+    return status;
+}
+
+// parallel [-j N] cmd [args...] ::: item...
+// Runs "cmd args item" for every item with at most N running at once
+// (default: one per online CPU). A new task starts as soon as SIGCHLD
+// reports that a slot is free. Per-task wall times and the makespan go
+// to stderr.
+void run_parallel(char *arglist[]) {
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if (arglist[1] != NULL && strcmp(arglist[1], "-j") == 0 && arglist[2] != NULL) {
+        slots = atol(arglist[2]);
+        first = 3;
+    }
+    int sep = first;
+    while (arglist[sep] != NULL && strcmp(arglist[sep], ":::") != 0)
+        sep++;
+    if (slots < 1 || sep == first || arglist[sep] == NULL) {
+        fprintf(stderr, "Usage: parallel [-j N] cmd [args...] ::: item...\n");
+        last_status = 2;
+        return;
+    }
+
+    int ncmd = sep - first;
+    char **items = &arglist[sep + 1];
+    int ntasks = 0;
+    while (items[ntasks] != NULL)
+        ntasks++;
+
+    long long t0 = now_ns();
+    long long busy = 0; // Sum of task wall times
+    int next = 0, running = 0, failed = 0, stopping = 0;
+    pid_t pgid = job_control ? 0 : -1; // Each task leads its own group
+    while ((next < ntasks && !interrupted) || running > 0) {
+        if (interrupted && !stopping) {
+            // Ctrl-C reached only the shell: start nothing more and pass
+            // it on to the running tasks
+            stopping = 1;
+            for (int j = 0; j < job_high; j++) {
+                if (jobs[j].pid != 0 && jobs[j].batch)
+                    kill(jobs[j].pgid > 0 ? -jobs[j].pgid : jobs[j].pid, SIGINT);
+            }
+        }
+        while (running < slots && next < ntasks && !interrupted) {
+            char **argv = arena_alloc(&cmd_arena, (ncmd + 2) * sizeof(char *));
+            memcpy(argv, &arglist[first], ncmd * sizeof(char *));
+            argv[ncmd] = items[next];
+            argv[ncmd + 1] = NULL;
+            long long started = now_ns();
+            pid_t pid = launch(argv, NULL, 0, pgid, 0);
+            if (pid < 0) {
+                failed++;
+            } else {
+                // The task's Job carries its full command for the report
+                size_t len = 0;
+                for (int k = 0; argv[k] != NULL; k++)
+                    len += strlen(argv[k]) + 1;
+                char *command = arena_alloc(&cmd_arena, len);
+                command[0] = '\0';
+                for (int k = 0; argv[k] != NULL; k++) {
+                    if (k > 0)
+                        strcat(command, " ");
+                    strcat(command, argv[k]);
+                }
+                add_job(&pid, 1, pgid >= 0 ? pid : 0, command, started)->batch = 1;
+                running++;
+            }
+            next++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        // Sleep until SIGCHLD, then free a slot for every task that ended
+        struct pollfd pfd = { sigchld_pipe[0], POLLIN, 0 };
+        if (!child_exited && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        char drain[64];
+        child_exited = 0;
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+            ;
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+            Job *job = find_job_by_pid(pid);
+            if (job == NULL) {
+                continue;
+            }
+            if (!job->batch) {
+                if (job_stage_done(job, pid, status, &usage)) {
+                    if (interactive) {
+                        printf("Job with PID %d terminated.\n", job->pid);
+                    }
+                    remove_job(job);
+                }
+                continue;
+            }
+            record_exit(pid, job->job_number, job->command, job->started, status, &usage);
+            long long wall = now_ns() - job->started;
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            fprintf(stderr, "[%d] exit %d, %.3f s: %s\n", job->job_number, code, wall / 1e9, job->command);
+            busy += wall;
+            if (code != 0)
+                failed++;
+            pid_map_delete(pid);
+            remove_job(job);
+            running--;
+        }
+    }
+
+    double makespan = (now_ns() - t0) / 1e9;
+    fprintf(stderr, "%d tasks, %d failed, -j %ld: makespan %.3f s, task time %.3f s (%.2fx)\n",
+            ntasks, failed, slots, makespan, busy / 1e9, makespan > 0 ? busy / 1e9 / makespan : 0.0);
+    last_status = interrupted ? 130 : failed ? 1 : 0;
+}
+
+// Remember how a command finished for jobstat, and append a line for it
+// to the file named by JOBLOG when that variable is set
+void record_exit(int pid, int job_number, char *command, long long started, int status, struct rusage *usage) {
+    JobStat *st = &job_stats[job_stats_count++ % JOBSTAT_SIZE];
+    st->pid = pid;
+    st->job_number = job_number;
+    st->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    st->wall = now_ns() - started;
+    st->usage = *usage;
+    snprintf(st->command, sizeof(st->command), "%s", command);
+
+    char *path = get_variable("JOBLOG");
+    if (path == NULL) {
+        return;
+    }
+    if (joblog_path == NULL || strcmp(joblog_path, path) != 0) {
+        if (joblog_fd >= 0)
+            close(joblog_fd);
+        free(joblog_path);
+        joblog_path = strdup(path);
+        joblog_fd = high_fd(open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+        if (joblog_fd < 0)
+            perror("JOBLOG");
+    }
+    if (joblog_fd < 0) {
+        return;
+    }
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+            "pid=%d job=%d status=%d wall_ms=%.3f user_ms=%.3f sys_ms=%.3f maxrss_kb=%ld nvcsw=%ld nivcsw=%ld cmd=%s\n",
+            pid, job_number, st->status, st->wall / 1e6,
+            usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3,
+            usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3,
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw, command);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    write(joblog_fd, line, len); // One O_APPEND write keeps lines whole
+}
+
+void show_jobstat() {
+    printf("%-6s %7s %6s %10s %9s %9s %9s %7s %7s  %s\n",
+           "JOB", "PID", "STATUS", "WALL(s)", "USER(s)", "SYS(s)", "RSS(KB)", "VCSW", "IVCSW", "COMMAND");
+    for (int i = 0; i < job_high; i++) {
+        if (jobs[i].pid != 0) {
+            char num[16];
+            snprintf(num, sizeof(num), "[%d]", jobs[i].job_number);
+            printf("%-6s %7d %6s %10.3f %9s %9s %9s %7s %7s  %s\n", num, jobs[i].pid, "run",
+                   (now_ns() - jobs[i].started) / 1e9, "-", "-", "-", "-", "-", jobs[i].command);
+        }
+    }
+    long first = job_stats_count > JOBSTAT_SIZE ? job_stats_count - JOBSTAT_SIZE : 0;
+    for (long n = first; n < job_stats_count; n++) {
+        JobStat *st = &job_stats[n % JOBSTAT_SIZE];
+        char num[16];
+        if (st->job_number > 0) {
+            snprintf(num, sizeof(num), "[%d]", st->job_number);
+        } else {
+            strcpy(num, "fg");
+        }
+        printf("%-6s %7d %6d %10.3f %9.3f %9.3f %9ld %7ld %7ld  %s\n", num, st->pid, st->status, st->wall / 1e9,
+               st->usage.ru_utime.tv_sec + st->usage.ru_utime.tv_usec / 1e6,
+               st->usage.ru_stime.tv_sec + st->usage.ru_stime.tv_usec / 1e6,
+               st->usage.ru_maxrss, st->usage.ru_nvcsw, st->usage.ru_nivcsw, st->command);
+    }
+}
+
+// time <command>: wall clock from CLOCK_MONOTONIC, CPU time from the
+// children's rusage, with no /usr/bin/time process in between
+void time_command(char *arglist[]) {
+    struct rusage before, after;
+    getrusage(RUSAGE_CHILDREN, &before);
+    long long t0 = now_ns();
+    run_command(arglist);
+    long long wall = now_ns() - t0;
+    getrusage(RUSAGE_CHILDREN, &after);
+    fflush(stdout);
+    fprintf(stderr, "\nreal\t%.6fs\nuser\t%.6fs\nsys\t%.6fs\n", wall / 1e9,
+            (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6,
+            (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6);
+}
+
+// bench [-n N] <command>: run the command N times (default 100) and
+// summarise the per-run latency
+void bench_command(char *arglist[]) {
+    long runs = 100;
+    int first = 1;
+    if (arglist[1] != NULL && strcmp(arglist[1], "-n") == 0 && arglist[2] != NULL) {
+        runs = atol(arglist[2]);
+        first = 3;
+    }
+    if (runs < 1 || arglist[first] == NULL) {
+        fprintf(stderr, "Usage: bench [-n N] <command>\n");
+        last_status = 2;
+        return;
+    }
+
+    LatencyStats st = { 0, 0, NULL };
+    long long total = 0;
+    for (long n = 0; n < runs; n++) {
+        long long t0 = now_ns();
+        run_command(&arglist[first]);
+        long long ns = now_ns() - t0;
+        stats_add(&st, ns);
+        total += ns;
+        if (child_exited) {
+            reap_children();
+        }
+    }
+
+    fflush(stdout);
+    long long p50 = stats_percentile(&st, 50); // Leaves the samples sorted
+    fprintf(stderr, "%ld runs: min %.1f us, mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            runs, st.ns[0] / 1e3, total / 1e3 / runs, p50 / 1e3,
+            stats_percentile(&st, 99) / 1e3, st.ns[st.count - 1] / 1e3);
+    print_histogram(&st);
+    free(st.ns);
+}
+
+// One row per power-of-two latency bucket that has samples
+void print_histogram(LatencyStats *st) {
+    long buckets[64] = { 0 };
+    long most = 0;
+    for (long i = 0; i < st->count; i++) {
+        int b = 0;
+        while (b < 62 && (1LL << (b + 1)) <= st->ns[i])
+            b++;
+        if (++buckets[b] > most)
+            most = buckets[b];
+    }
+    for (int b = 0; b < 64; b++) {
+        if (buckets[b] == 0) {
+            continue;
+        }
+        char bar[41];
+        int width = (int)(buckets[b] * 40 / most);
+        memset(bar, '#', width);
+        bar[width] = '\0';
+        fprintf(stderr, "%10.1f - %10.1f us | %-40s %ld\n",
+                (1LL << b) / 1e3, (1LL << (b + 1)) / 1e3, bar, buckets[b]);
+    }
+}
+
+// Add entry n's trigrams to the index. Ids arrive in increasing order, so a
+// gram repeated within the line is caught by comparing with the last id.
+void index_entry(long n) {
+    HistEntry *e = &hist_entries[n - 1];
+    unsigned int g = 0x0101; // Two sentinels anchor the start of the line
+    for (size_t i = 0; i < e->len; i++) {
+        g = ((g << 8) | (unsigned char)e->text[i]) & 0xffffff;
+        if (2 * (gram_used + 1) > gram_capacity) {
+            unsigned int old_capacity = gram_capacity;
+            GramList *old = grams;
+            gram_capacity = gram_capacity ? gram_capacity * 2 : 4096;
+            grams = calloc(gram_capacity, sizeof(GramList));
+            for (unsigned int j = 0; j < old_capacity; j++) {
+                if (old[j].gram) {
+                    *find_gram(old[j].gram & 0xffffff) = old[j];
+                }
+            }
+            free(old);
+        }
+        GramList *list = find_gram(g);
+        if (list->gram == 0) {
+            list->gram = g | 0x1000000;
+            gram_used++;
+        } else if (list->ids[list->count - 1] == n) {
+            continue;
+        }
+        if (list->count == list->cap) {
+            list->cap = list->cap ? list->cap * 2 : 4;
+            list->ids = realloc(list->ids, list->cap * sizeof(unsigned int));
+        }
+        list->ids[list->count++] = n;
+    }
+    grams_indexed = n;
+}
+
+// Index every entry not yet in the trigram index
+void index_grams() {
+    index_history();
+    while (grams_indexed < hist_count) {
+        index_entry(grams_indexed + 1);
+    }
+}
+
+// Slot holding gram, or the empty slot where it would go
+GramList *find_gram(unsigned int gram) {
+    unsigned int mask = gram_capacity - 1;
+    unsigned int i = (gram * 2654435761u) & mask;
+    while (grams[i].gram != 0 && grams[i].gram != (gram | 0x1000000)) {
+        i = (i + 1) & mask;
+    }
+    return &grams[i];
+}
+
+// Shortest posting list among the pattern's trigrams. Returns -1 if one of
+// them never occurs; *ids is NULL when the pattern is too short to use the
+// index and every entry must be checked.
+int search_candidates(const char *pat, int prefix, unsigned int **ids, long *count) {
+    index_grams();
+    *ids = NULL;
+    *count = hist_count;
+    size_t len = strlen(pat);
+    if ((!prefix && len < 3) || gram_capacity == 0) {
+        return 0;
+    }
+    unsigned int g = prefix ? 0x0101 : 0;
+    for (size_t i = 0; i < len; i++) {
+        g = ((g << 8) | (unsigned char)pat[i]) & 0xffffff;
+        if (!prefix && i < 2) {
+            continue;
+        }
+        GramList *list = find_gram(g);
+        if (list->gram == 0) {
+            return -1;
+        }
+        if (*ids == NULL || list->count < *count) {
+            *ids = list->ids;
+            *count = list->count;
+        }
+    }
+    return 0;
+}
+
+int history_matches(long n, const char *pat, size_t len, int prefix) {
+    HistEntry *e = &hist_entries[n - 1];
+    if (prefix) {
+        return e->len >= len && memcmp(e->text, pat, len) == 0;
+    }
+    return memmem(e->text, e->len, pat, len) != NULL;
+}
+
+// Most recent entry starting with (or containing) pat, 0 if there is none
+long history_find(const char *pat, int prefix) {
+    unsigned int *ids;
+    long count;
+    if (search_candidates(pat, prefix, &ids, &count) < 0) {
+        return 0;
+    }
+    size_t len = strlen(pat);
+    for (long i = count - 1; i >= 0; i--) {
+        long n = ids ? ids[i] : i + 1;
+        if (history_matches(n, pat, len, prefix)) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+// List every entry starting with (or containing) pat
+void search_history(char *pat, int prefix) {
+    unsigned int *ids;
+    long count;
+    if (search_candidates(pat, prefix, &ids, &count) < 0) {
+        return;
+    }
+    size_t len = strlen(pat);
+    for (long i = 0; i < count; i++) {
+        long n = ids ? ids[i] : i + 1;
+        if (history_matches(n, pat, len, prefix)) {
+            HistEntry *e = &hist_entries[n - 1];
+            printf("%5ld  %.*s\n", n, (int)e->len, e->text);
+        }
+    }
+}
+
+// Read a line in raw mode with cursor movement, history on up/down and tab
+// completion. Only the changed part of the line is redrawn. NULL on EOF.
+char *edit_line(const char *prompt) {
+    LineEditor *ed = &editor;
+    struct termios raw = cooked_termios;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~IXON;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    if (ed->cap == 0) {
+        ed->cap = MAX_LEN;
+        ed->buf = malloc(ed->cap);
+    }
+    ed->prompt = prompt;
+    ed->prompt_width = text_width(prompt, strlen(prompt));
+    editor_size();
+    ed->len = ed->pos = 0;
+    ed->hist = 0;
+    editor_put(prompt, strlen(prompt));
+    char *line = NULL;
+    while (1) {
+        int c = editor_key();
+        if (c == 27) {
+            // Escape sequences: ESC [ or ESC O, optional numbers, final byte
+            int c1 = editor_key();
+            int num = 0, params = 0;
+            if (c1 == '[' || c1 == 'O') {
+                c = editor_key();
+                while ((c >= '0' && c <= '9') || c == ';') {
+                    if (c == ';') {
+                        params = 1; // Only the first number matters
+                    } else if (!params && num < 100) {
+                        num = num * 10 + c - '0';
+                    }
+                    c = editor_key();
+                }
+            } else {
+                continue;
+            }
+            if (c == '~') {
+                c = num == 1 || num == 7 ? 'H' : num == 4 || num == 8 ? 'F' : num == 3 ? 'X' : 0;
+            }
+            if (c == 'A') {
+                c = 16;
+            } else if (c == 'B') {
+                c = 14;
+            } else if (c == 'C') {
+                c = 6;
+            } else if (c == 'D') {
+                c = 2;
+            } else if (c == 'H') {
+                c = 1;
+            } else if (c == 'F') {
+                c = 5;
+            } else if (c == 'X') {
+                if (ed->pos < ed->len) {
+                    editor_delete(editor_next(ed->pos) - ed->pos);
+                }
+                continue;
+            } else {
+                continue;
+            }
+        }
+
+        if (c < 0) {
+            break; // Input closed
+        } else if (c == '\r' || c == '\n') {
+            editor_goto(ed->len);
+            if (editor_column(ed->len) % ed->cols != 0)
+                editor_put("\n", 1); // Else already at the start of a new row
+            line = ed->buf;
+            break;
+        } else if (c == 4) { // Ctrl-D: EOF on an empty line, else delete
+            if (ed->len == 0) {
+                break;
+            }
+            if (ed->pos < ed->len) {
+                editor_delete(editor_next(ed->pos) - ed->pos);
+            }
+        } else if (c == 127 || c == 8) {
+            if (ed->pos > 0) {
+                size_t end = ed->pos;
+                editor_goto(editor_prev(ed->pos));
+                editor_delete(end - ed->pos);
+            }
+        } else if (c == 1) {
+            editor_goto(0);
+        } else if (c == 5) {
+            editor_goto(ed->len);
+        } else if (c == 2) {
+            if (ed->pos > 0) {
+                editor_goto(editor_prev(ed->pos));
+            }
+        } else if (c == 6) {
+            if (ed->pos < ed->len) {
+                editor_goto(editor_next(ed->pos));
+            }
+        } else if (c == 16) {
+            editor_history(-1);
+        } else if (c == 14) {
+            editor_history(1);
+        } else if (c == 11) { // Ctrl-K: kill to end of line
+            editor_put("\033[J", 3);
+            ed->len = ed->pos;
+        } else if (c == 21) { // Ctrl-U: kill to start of line
+            size_t n = ed->pos;
+            editor_goto(0);
+            editor_delete(n);
+        } else if (c == 12) { // Ctrl-L: clear screen
+            editor_put("\033[H\033[2J", 7);
+            editor_refresh(prompt);
+        } else if (c == 3) { // Ctrl-C: discard the line
+            editor_goto(ed->len);
+            editor_put("^C\n", 3);
+            editor_put(prompt, strlen(prompt));
+            ed->len = ed->pos = 0;
+            ed->hist = 0;
+        } else if (c == '\t') {
+            editor_complete(prompt);
+        } else if (c >= 32) {
+            // A UTF-8 character goes in whole, so the terminal never sees
+            // half of one between the escape sequences of a redraw
+            char ch[4] = { c };
+            int n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1, k = 1;
+            while (k < n) {
+                c = editor_key();
+                if ((c & 0xC0) != 0x80) {
+                    if (c >= 0)
+                        ed->key_pos--; // Not part of it: handled next
+                    break;
+                }
+                ch[k++] = c;
+            }
+            editor_insert(ch, k);
+        }
+    }
+    editor_flush();
+    tcsetattr(STDIN_FILENO, TCSANOW, &cooked_termios);
+    if (line != NULL) {
+        line[ed->len] = '\0';
+    }
+    return line;
+}
+
+// Next input byte, or -1 at EOF. Pending output is written before waiting,
+// and finished background jobs are reported above the line being edited.
+int editor_key() {
+    LineEditor *ed = &editor;
+    while (ed->key_pos == ed->key_len) {
+        if (child_exited) {
+            editor_clear();
+            editor_flush();
+            reap_children();
+            fflush(stdout);
+            editor_refresh(ed->prompt);
+            continue;
+        }
+        if (window_changed) {
+            window_changed = 0;
+            editor_size();
+        }
+        editor_flush();
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { sigchld_pipe[0], POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (fds[0].revents == 0) {
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, ed->keys, sizeof(ed->keys));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        ed->key_pos = 0;
+        ed->key_len = n;
+    }
+    return (unsigned char)ed->keys[ed->key_pos++];
+}
+
+void editor_put(const char *s, size_t n) {
+    LineEditor *ed = &editor;
+    if (ed->out_len + n > ed->out_cap) {
+        ed->out_cap = (ed->out_len + n) * 2;
+        ed->out = realloc(ed->out, ed->out_cap);
+    }
+    memcpy(ed->out + ed->out_len, s, n);
+    ed->out_len += n;
+}
+
+void editor_flush() {
+    LineEditor *ed = &editor;
+    size_t done = 0;
+    while (done < ed->out_len) {
+        ssize_t n = write(STDOUT_FILENO, ed->out + done, ed->out_len - done);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        done += n > 0 ? n : 0;
+    }
+    ed->out_len = 0;
+}
+
+// Screen columns taken by n bytes of UTF-8 text: one per character
+size_t text_width(const char *s, size_t n) {
+    size_t width = 0;
+    for (size_t i = 0; i < n; i++) {
+        width += (s[i] & 0xC0) != 0x80;
+    }
+    return width;
+}
+
+// Column of offset pos in the line, counted from the start of the prompt
+// across every row the line wraps onto
+size_t editor_column(size_t pos) {
+    return editor.prompt_width + text_width(editor.buf, pos);
+}
+
+// Offset of the character before or after the one at pos
+size_t editor_prev(size_t pos) {
+    do {
+        pos--;
+    } while (pos > 0 && (editor.buf[pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+size_t editor_next(size_t pos) {
+    do {
+        pos++;
+    } while (pos < editor.len && (editor.buf[pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+void editor_size() {
+    struct winsize ws;
+    editor.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+}
+
+// Move the cursor between two columns of the line, up or down a row
+// where it wraps
+void editor_cursor(size_t from, size_t to) {
+    size_t cols = editor.cols;
+    long rows = (long)(to / cols) - (long)(from / cols);
+    long n = (long)(to % cols) - (long)(from % cols);
+    char seq[32];
+    if (rows != 0) {
+        editor_put(seq, snprintf(seq, sizeof(seq), "\033[%ld%c", rows < 0 ? -rows : rows, rows < 0 ? 'A' : 'B'));
+    }
+    if (n == -1) {
+        editor_put("\b", 1);
+    } else if (n != 0) {
+        editor_put(seq, snprintf(seq, sizeof(seq), "\033[%ld%c", n < 0 ? -n : n, n < 0 ? 'D' : 'C'));
+    }
+}
+
+void editor_goto(size_t pos) {
+    editor_cursor(editor_column(editor.pos), editor_column(pos));
+    editor.pos = pos;
+}
+
+// Write the line from pos to its end; the cursor is then at the end. A
+// line ending at the right margin leaves the terminal waiting to wrap, so
+// a space and CR move it to the start of the next row as counted.
+void editor_put_tail(size_t pos) {
+    LineEditor *ed = &editor;
+    editor_put(ed->buf + pos, ed->len - pos);
+    if (editor_column(ed->len) % ed->cols == 0) {
+        editor_put(" \r", 2);
+    }
+}
+
+// Erase every row of the line, leaving the cursor where the prompt was
+void editor_clear() {
+    size_t col = editor_column(editor.pos);
+    editor_cursor(col, col % editor.cols); // Up to the first row; CR does the rest
+    editor_put("\r\033[J", 4);
+}
+
+// Redraw the prompt and the whole line, from the start of the cursor's row
+void editor_refresh(const char *prompt) {
+    LineEditor *ed = &editor;
+    editor_put("\r", 1);
+    editor_put(prompt, strlen(prompt));
+    editor_put_tail(0);
+    editor_put("\033[J", 3);
+    editor_cursor(editor_column(ed->len), editor_column(ed->pos));
+}
+
+// Insert at the cursor; only the text from the cursor on is redrawn
+void editor_insert(const char *s, size_t n) {
+    LineEditor *ed = &editor;
+    if (ed->len + n + 1 > ed->cap) {
+        ed->cap = (ed->len + n + 1) * 2;
+        ed->buf = realloc(ed->buf, ed->cap);
+    }
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->len += n;
+    editor_put_tail(ed->pos);
+    size_t pos = ed->pos + n;
+    ed->pos = ed->len;
+    editor_goto(pos);
+}
+
+// Delete n bytes at the cursor
+void editor_delete(size_t n) {
+    LineEditor *ed = &editor;
+    memmove(ed->buf + ed->pos, ed->buf + ed->pos + n, ed->len - ed->pos - n);
+    ed->len -= n;
+    editor_put_tail(ed->pos);
+    editor_put("\033[J", 3);
+    size_t pos = ed->pos;
+    ed->pos = ed->len;
+    editor_goto(pos);
+}
+
+// Replace the whole line, leaving the cursor at its end
+void editor_replace(const char *text, size_t n) {
+    LineEditor *ed = &editor;
+    editor_goto(0);
+    ed->len = 0;
+    editor_insert(text, n);
+    editor_put("\033[J", 3);
+}
+
+// Show the previous (step -1) or next history entry
+void editor_history(long step) {
+    LineEditor *ed = &editor;
+    index_history();
+    long cur = ed->hist ? ed->hist : hist_count + 1;
+    long n = cur + step;
+    if (n < 1 || n > hist_count + 1) {
+        return;
+    }
+    if (ed->hist == 0) {
+        free(ed->draft);
+        ed->draft = strndup(ed->buf ? ed->buf : "", ed->len);
+    }
+    if (n == hist_count + 1) {
+        ed->hist = 0;
+        editor_replace(ed->draft, strlen(ed->draft));
+    } else {
+        ed->hist = n;
+        editor_replace(hist_entries[n - 1].text, hist_entries[n - 1].len);
+    }
+}
+
+static int compare_names(const void *a, const void *b) {
+    const CompName *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    return c ? c : x->dir - y->dir;
+}
+
+// Complete the word before the cursor: a command name for the first word,
+// a file name otherwise. With several candidates the common prefix is
+// inserted, or they are listed if there is nothing to add.
+void editor_complete(const char *prompt) {
+    LineEditor *ed = &editor;
+    size_t start = ed->pos;
+    while (start > 0 && ed->buf[start - 1] != ' ') {
+        start--;
+    }
+    size_t first = 0;
+    while (first < start && ed->buf[first] == ' ') {
+        first++;
+    }
+    char *word = arena_alloc(&cmd_arena, ed->pos - start + 1);
+    memcpy(word, ed->buf + start, ed->pos - start);
+    word[ed->pos - start] = '\0';
+
+    char *slash = strrchr(word, '/');
+    char *prefix = slash ? slash + 1 : word;
+    CompName *found;
+    long n = 0;
+    int commands = first == start && slash == NULL;
+    if (commands) {
+        refresh_command_index();
+        found = lookup_names(comp_names, comp_count, word, &n);
+    } else {
+        char *dir = ".";
+        if (slash != NULL) {
+            dir = arena_alloc(&cmd_arena, slash - word + 2);
+            memcpy(dir, word, slash - word + 1);
+            dir[slash - word + 1] = '\0';
+        }
+        DirListing *l = dir_listing(dir);
+        found = l ? lookup_names(l->names, l->count, prefix, &n) : NULL;
+    }
+
+    // Candidates: no dot files unless asked (the command index only has
+    // executables)
+    char **names = arena_alloc(&cmd_arena, (n + 1) * sizeof(char *));
+    long count = 0;
+    for (long i = 0; found != NULL && i < n; i++) {
+        CompName *c = &found[i];
+        if (!commands && c->name[0] == '.' && prefix[0] != '.') {
+            continue;
+        }
+        char *name = c->name;
+        if (!commands && c->dir) {
+            name = arena_alloc(&cmd_arena, strlen(c->name) + 2);
+            sprintf(name, "%s/", c->name);
+        }
+        names[count++] = name;
+    }
+
+    if (count == 0) {
+        editor_put("\a", 1);
+        return;
+    }
+    size_t common = strlen(names[0]);
+    for (long i = 1; i < count; i++) {
+        size_t j = 0;
+        while (j < common && names[i][j] == names[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+
+    size_t have = strlen(prefix);
+    if (count == 1) {
+        editor_insert(names[0] + have, common - have);
+        if (names[0][common - 1] != '/') {
+            editor_insert(" ", 1);
+        }
+    } else if (common > have) {
+        editor_insert(names[0] + have, common - have);
+    } else {
+        editor_goto(ed->len);
+        editor_put("\n", 1);
+        if (count > 200) {
+            char msg[64];
+            editor_put(msg, snprintf(msg, sizeof(msg), "%ld possibilities", count));
+        }
+        for (long i = 0; i < count && count <= 200; i++) {
+            editor_put(names[i], strlen(names[i]));
+            editor_put("  ", 2);
+        }
+        editor_put("\n", 1);
+        editor_refresh(prompt);
+    }
+}
+
+// Rebuild the command index if PATH changed or one of its directories was
+// modified since the last scan. Costs one stat per PATH entry.
+void refresh_command_index() {
+    char *path = search_path();
+    int stale = comp_path == NULL || strcmp(comp_path, path) != 0;
+    for (int i = 0; i < comp_dir_count && !stale; i++) {
+        struct stat st;
+        if (stat(comp_dirs[i].path, &st) < 0) {
+            memset(&st, 0, sizeof(st));
+        }
+        stale = st.st_mtim.tv_sec != comp_dirs[i].mtime.tv_sec ||
+                st.st_mtim.tv_nsec != comp_dirs[i].mtime.tv_nsec;
+    }
+    if (stale) {
+        build_command_index(path);
+    }
+}
+
+// Read every PATH directory into one sorted array with the builtins. A
+// name found in several directories keeps the first, as lookup would.
+void build_command_index(char *path) {
+    arena_reset(&comp_arena);
+    free(comp_path);
+    comp_path = strdup(path);
+    comp_count = 0;
+    comp_dir_count = 0;
+    long cap = 1024;
+    free(comp_names);
+    comp_names = malloc(cap * sizeof(CompName));
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        comp_names[comp_count].name = (char *)builtins[i].name;
+        comp_names[comp_count++].dir = -1;
+    }
+
+    char *dirs = arena_strdup(&comp_arena, path);
+    int dir_cap = 0;
+    for (char *dir = strtok(dirs, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+        if (comp_dir_count == dir_cap) {
+            dir_cap = dir_cap ? dir_cap * 2 : 16;
+            comp_dirs = realloc(comp_dirs, dir_cap * sizeof(CompDir));
+        }
+        CompDir *cd = &comp_dirs[comp_dir_count++];
+        struct stat st;
+        cd->path = dir;
+        memset(&cd->mtime, 0, sizeof(cd->mtime));
+        DIR *d = opendir(dir);
+        if (d == NULL) {
+            continue; // A missing directory is remembered with mtime 0
+        }
+        if (fstat(dirfd(d), &st) == 0) {
+            cd->mtime = st.st_mtim;
+        }
+        // Only regular files we may run are indexed, so Tab does not
+        // have to check each candidate
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.' || ent->d_type == DT_DIR) {
+                continue;
+            }
+            if (ent->d_type != DT_REG && (fstatat(dirfd(d), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))) {
+                continue;
+            }
+            if (faccessat(dirfd(d), ent->d_name, X_OK, 0) < 0) {
+                continue;
+            }
+            if (comp_count == cap) {
+                cap *= 2;
+                comp_names = realloc(comp_names, cap * sizeof(CompName));
+            }
+            comp_names[comp_count].name = arena_strdup(&comp_arena, ent->d_name);
+            comp_names[comp_count++].dir = comp_dir_count - 1;
+        }
+        closedir(d);
+    }
+
+    qsort(comp_names, comp_count, sizeof(CompName), compare_names);
+    long unique = comp_count > 0;
+    for (long i = 1; i < comp_count; i++) {
+        if (strcmp(comp_names[i].name, comp_names[unique - 1].name) != 0) {
+            comp_names[unique++] = comp_names[i];
+        }
+    }
+    comp_count = unique;
+}
+
+// First of the n names starting with prefix, by binary search
+CompName *lookup_names(CompName *names, long count, const char *prefix, long *n) {
+    size_t len = strlen(prefix);
+    long lo = 0, hi = count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (strcmp(names[mid].name, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    long end = lo;
+    while (end < count && strncmp(names[end].name, prefix, len) == 0) {
+        end++;
+    }
+    *n = end - lo;
+    return names + lo;
+}
+
+// Sorted listing of dir, cached until the directory changes or cd runs
+DirListing *dir_listing(char *dir) {
+    struct stat st;
+    if (stat(dir, &st) < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < listing_count; i++) {
+        if (strcmp(listings[i].dir, dir) == 0) {
+            if (listings[i].mtime.tv_sec == st.st_mtim.tv_sec &&
+                listings[i].mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                return &listings[i];
+            }
+            clear_dir_listings(); // Stale: start over rather than free one
+            break;
+        }
+    }
+    if (listing_count == LISTING_CACHE_SIZE) {
+        clear_dir_listings();
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return NULL;
+    }
+    DirListing *l = &listings[listing_count++];
+    l->dir = arena_strdup(&listing_arena, dir);
+    l->mtime = st.st_mtim;
+    l->names = NULL;
+    l->count = 0;
+    long cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        int is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+            struct stat est;
+            is_dir = fstatat(dirfd(d), ent->d_name, &est, 0) == 0 && S_ISDIR(est.st_mode);
+        }
+        if (l->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            l->names = realloc(l->names, cap * sizeof(CompName));
+        }
+        l->names[l->count].name = arena_strdup(&listing_arena, ent->d_name);
+        l->names[l->count++].dir = is_dir;
+    }
+    closedir(d);
+    qsort(l->names, l->count, sizeof(CompName), compare_names);
+    return l;
+}
+
+void clear_dir_listings() {
+    for (int i = 0; i < listing_count; i++) {
+        free(listings[i].names);
+    }
+    listing_count = 0;
+    arena_reset(&listing_arena);
+}
+
+// Compile text, which may span several lines, into a. On a syntax error
+// NULL is returned with *error set, and *incomplete tells whether more
+// lines could still complete the command.
+CommandList *parse_line(Arena *a, char *text, char **error, int *incomplete) {
+    Parser ps;
+    parser_init(&ps, a, text);
+    CommandList *list = arena_alloc(a, sizeof(CommandList));
+    list->items = NULL;
+    list->count = 0;
+    while (ps.tok != TOK_END && ps.error == NULL) {
+        if (ps.tok == TOK_NEWLINE)
+            next_token(&ps);
+        else
+            parse_list(&ps, list, 0);
+    }
+    free(ps.buf);
+    *error = ps.error;
+    *incomplete = ps.incomplete;
+    return ps.error != NULL ? NULL : list;
+}
+
+void parser_init(Parser *ps, Arena *a, char *text) {
+    memset(ps, 0, sizeof(Parser));
+    ps->p = ps->start = ps->end = ps->prev_start = ps->prev_end = text;
+    ps->arena = a;
+    ps->buf = malloc(2 * strlen(text) + 1);
+    next_token(ps);
+}
+
+// And-or lists separated by ; and &. At the top level the list ends at a
+// newline. In a part of a compound command newlines separate like ; and
+// the list ends at the keyword after the part (then, do, fi...).
+int parse_list(Parser *ps, CommandList *list, int compound) {
+    while (1) {
+        while (compound && ps->tok == TOK_NEWLINE)
+            next_token(ps);
+        if (ps->tok == TOK_END || ps->tok == TOK_NEWLINE || (compound && ends_part(ps))) {
+            return 0;
+        }
+        AndOr *ao = arena_push(ps->arena, &list->items, &list->count, sizeof(AndOr));
+        if (parse_and_or(ps, ao) < 0) {
+            return -1;
+        }
+        if (ps->tok == TOK_AMP) {
+            if (ao->npipes == 1)
+                ao->pipes[0].background = 1;
+            else
+                ao->background = 1;
+        }
+        if (ps->tok == TOK_AMP || ps->tok == TOK_SEMI) {
+            next_token(ps);
+        } else if (ps->tok != TOK_NEWLINE && ps->tok != TOK_END) {
+            return syntax_error(ps, NULL);
+        }
+    }
+}
+
+// One part of a compound command, which may not be empty
+CommandList *parse_part(Parser *ps) {
+    CommandList *list = arena_alloc(ps->arena, sizeof(CommandList));
+    list->items = NULL;
+    list->count = 0;
+    if (parse_list(ps, list, 1) < 0) {
+        return NULL;
+    }
+    if (list->count == 0) {
+        if (ps->tok == TOK_END)
+            need_more(ps, "unexpected end of input");
+        else
+            syntax_error(ps, NULL);
+        return NULL;
+    }
+    return list;
+}
+
+int parse_and_or(Parser *ps, AndOr *ao) {
+    char *start = ps->start;
+    int op = 0;
+    while (1) {
+        Pipeline *p = arena_push(ps->arena, &ao->pipes, &ao->npipes, sizeof(Pipeline));
+        p->op = op;
+        if (parse_pipeline(ps, p) < 0) {
+            return -1;
+        }
+        if (ps->tok != TOK_AND_IF && ps->tok != TOK_OR_IF) {
+            break;
+        }
+        op = ps->tok;
+        do
+            next_token(ps);
+        while (ps->tok == TOK_NEWLINE);
+    }
+    ao->text = arena_strndup(ps->arena, start, ps->prev_end - start);
+    return 0;
+}
+
+int parse_pipeline(Parser *ps, Pipeline *p) {
+    char *start = ps->start;
+    while (1) {
+        Command *cmd = arena_push(ps->arena, &p->cmds, &p->ncmds, sizeof(Command));
+        if (parse_command(ps, cmd) < 0) {
+            return -1;
+        }
+        if (ps->tok != TOK_PIPE) {
+            break;
+        }
+        do
+            next_token(ps);
+        while (ps->tok == TOK_NEWLINE);
+    }
+    for (int i = 0; p->ncmds > 1 && i < p->ncmds; i++) {
+        if (p->cmds[i].type == CMD_SIMPLE && p->cmds[i].argc == 0) {
+            return syntax_error(ps, "pipeline stage without a command");
+        }
+    }
+    p->text = arena_strndup(ps->arena, start, ps->prev_end - start);
+    return 0;
+}
+
+// A simple command is words and redirections in any order. A compound
+// command can only be followed by redirections.
+int parse_command(Parser *ps, Command *cmd) {
+    int compound = 0;
+    if (is_keyword(ps, "if")) {
+        compound = 1;
+        if (parse_if(ps, cmd) < 0)
+            return -1;
+    } else if (is_keyword(ps, "while") || is_keyword(ps, "until")) {
+        compound = 1;
+        if (parse_loop(ps, cmd) < 0)
+            return -1;
+    } else if (is_keyword(ps, "for")) {
+        compound = 1;
+        if (parse_for(ps, cmd) < 0)
+            return -1;
+    } else if (ends_part(ps)) {
+        return syntax_error(ps, NULL);
+    }
+
+    while (ps->tok == TOK_REDIRECT || (ps->tok == TOK_WORD && !compound)) {
+        if (ps->tok != TOK_WORD) {
+            if (parse_redirect(ps, cmd) < 0)
+                return -1;
+            continue;
+        }
+        add_word(ps, cmd);
+        next_token(ps);
+    }
+    if (ps->error != NULL) {
+        return -1;
+    }
+    if (compound) {
+        return ps->tok == TOK_WORD ? syntax_error(ps, NULL) : 0;
+    }
+    if (cmd->argc == 0 && cmd->nredirs == 0) {
+        return ps->tok == TOK_END ? need_more(ps, NULL) : syntax_error(ps, NULL);
+    }
+    finish_words(ps, cmd);
+    if (!cmd->expand)
+        cmd->builtin = cmd->argc > 0 ? find_builtin(cmd->argv[0]) : NULL;
+    return 0;
+}
+
+// if list; then list; [elif list; then list;]... [else list;] fi. An
+// elif is kept as an if nested in the else part.
+int parse_if(Parser *ps, Command *cmd) {
+    cmd->type = CMD_IF;
+    next_token(ps);
+    if ((cmd->cond = parse_part(ps)) == NULL || expect_keyword(ps, "then") < 0 ||
+        (cmd->body = parse_part(ps)) == NULL) {
+        return -1;
+    }
+    if (is_keyword(ps, "elif")) {
+        CommandList *list = arena_alloc(ps->arena, sizeof(CommandList));
+        list->items = NULL;
+        list->count = 0;
+        AndOr *ao = arena_push(ps->arena, &list->items, &list->count, sizeof(AndOr));
+        Pipeline *p = arena_push(ps->arena, &ao->pipes, &ao->npipes, sizeof(Pipeline));
+        ao->text = p->text = "elif";
+        cmd->orelse = list;
+        return parse_if(ps, arena_push(ps->arena, &p->cmds, &p->ncmds, sizeof(Command)));
+    }
+    if (is_keyword(ps, "else")) {
+        next_token(ps);
+        if ((cmd->orelse = parse_part(ps)) == NULL)
+            return -1;
+    }
+    return expect_keyword(ps, "fi");
+}
+
+// while list; do list; done, and the same with until
+int parse_loop(Parser *ps, Command *cmd) {
+    cmd->type = is_keyword(ps, "while") ? CMD_WHILE : CMD_UNTIL;
+    next_token(ps);
+    if ((cmd->cond = parse_part(ps)) == NULL || expect_keyword(ps, "do") < 0 ||
+        (cmd->body = parse_part(ps)) == NULL) {
+        return -1;
+    }
+    return expect_keyword(ps, "done");
+}
+
+// for NAME [in word...]; do list; done. The words are kept in argv and
+// expanded when the loop starts.
+int parse_for(Parser *ps, Command *cmd) {
+    cmd->type = CMD_FOR;
+    next_token(ps);
+    int valid = ps->tok == TOK_WORD && !ps->quoted && is_name_char(ps->word[0], 1);
+    for (int i = 1; valid && ps->word[i] != '\0'; i++)
+        valid = is_name_char(ps->word[i], 0);
+    if (!valid) {
+        return ps->tok == TOK_END ? need_more(ps, NULL) : syntax_error(ps, "bad for loop variable");
+    }
+    cmd->var = ps->word;
+    next_token(ps);
+    while (ps->tok == TOK_NEWLINE)
+        next_token(ps);
+    if (is_keyword(ps, "in")) {
+        for (next_token(ps); ps->tok == TOK_WORD; next_token(ps))
+            add_word(ps, cmd);
+        if (ps->tok != TOK_SEMI && ps->tok != TOK_NEWLINE) {
+            return ps->tok == TOK_END ? need_more(ps, "missing 'do'") : syntax_error(ps, NULL);
+        }
+        next_token(ps);
+    } else if (ps->tok == TOK_SEMI) {
+        next_token(ps);
+    }
+    finish_words(ps, cmd);
+    while (ps->tok == TOK_NEWLINE)
+        next_token(ps);
+    if (expect_keyword(ps, "do") < 0 || (cmd->body = parse_part(ps)) == NULL) {
+        return -1;
+    }
+    return expect_keyword(ps, "done");
+}
+
+int parse_redirect(Parser *ps, Command *cmd) {
+    int fd = ps->redir_fd, op = ps->redir_op;
+    char *start = ps->start;
+    int len = ps->end - ps->start;
+    next_token(ps);
+    if (ps->tok != TOK_WORD) {
+        char what[64];
+        snprintf(what, sizeof(what), "missing %s after '%.*s'",
+                 op == REDIR_DUP ? "descriptor" : op == REDIR_HEREDOC || op == REDIR_HERETABS ? "delimiter"
+                 : op == REDIR_HERESTRING ? "word" : "file name", len, start);
+        return syntax_error(ps, what);
+    }
+    Redirect *r = arena_push(ps->arena, &cmd->redirs, &cmd->nredirs, sizeof(Redirect));
+    r->fd = fd;
+    r->op = op;
+    r->target = ps->word;
+    r->expand = ps->expand;
+    if (op == REDIR_HEREDOC || op == REDIR_HERETABS) {
+        if (ps->expand) {
+            return syntax_error(ps, "$ in a here-document delimiter");
+        }
+        // The body is read now, from the lines after this one; the
+        // newline ending this line skips over it
+        r->op = REDIR_HEREDOC;
+        unescape_word(r->target);
+        if (read_heredoc(ps, r, ps->word, op == REDIR_HERETABS, ps->quoted) < 0) {
+            return -1;
+        }
+        next_token(ps);
+        return 0;
+    } else if (op == REDIR_HERESTRING) {
+        r->op = REDIR_HEREDOC;
+        size_t n = strlen(r->target);
+        char *text = arena_alloc(ps->arena, n + 2);
+        memcpy(text, r->target, n);
+        memcpy(text + n, "\n", 2);
+        r->target = text;
+    } else if (op == REDIR_DUP && (r->expand || (strcmp(r->target, "-") != 0 &&
+                                                 (!isdigit((unsigned char)r->target[0]) || r->target[1] != '\0')))) {
+        return syntax_error(ps, "a descriptor (0-9) or - must follow >& and <&");
+    }
+    if (!r->expand)
+        unescape_word(r->target);
+    next_token(ps);
+    return 0;
+}
+
+// Read a here-document body: the lines after the current one (or after
+// the bodies already read for it) up to a line that is just delim. In an
+// unquoted body $ expands and \ quotes $, \ and newline, as in "...".
+int read_heredoc(Parser *ps, Redirect *r, const char *delim, int strip_tabs, int literal) {
+    if (ps->line_end == NULL) {
+        ps->line_end = strchr(ps->p, '\n');
+        if (ps->line_end == NULL) {
+            return need_more(ps, "unterminated here-document");
+        }
+        ps->body_end = ps->line_end + 1;
+    }
+    char *line = ps->body_end;
+    char *out = ps->buf;
+    size_t dlen = strlen(delim);
+    int expand = ps->expand = 0;
+    while (1) {
+        if (*line == '\0') {
+            ps->body_end = line; // All the rest was the body
+            return need_more(ps, "unterminated here-document");
+        }
+        char *eol = line + strcspn(line, "\n");
+        char *s = line;
+        while (strip_tabs && *s == '\t')
+            s++;
+        line = *eol == '\n' ? eol + 1 : eol;
+        if ((size_t)(eol - s) == dlen && memcmp(s, delim, dlen) == 0) {
+            break;
+        }
+        while (s < line) {
+            size_t run = literal ? (size_t)(line - s) : strcspn(s, "\\$\n");
+            if (run > 0) {
+                memcpy(out, s, run); // Plain text is copied a run at a time
+                out += run;
+                s += run;
+            } else if (*s == '\\' && s[1] == '\n') {
+                s += 2;
+            } else if (*s == '\\' && (s[1] == '$' || s[1] == '\\')) {
+                out = escape_char(out, s[1]);
+                s += 2;
+            } else if (*s == '$') {
+                out = copy_expansion(ps, out, &s);
+                s++;
+            } else {
+                out = escape_char(out, *s++);
+            }
+        }
+    }
+    expand = ps->expand;
+    ps->body_end = line;
+    r->target = arena_strndup(ps->arena, ps->buf, out - ps->buf);
+    r->expand = expand;
+    if (!expand && !literal)
+        unescape_word(r->target);
+    return 0;
+}
+
+void add_word(Parser *ps, Command *cmd) {
+    *(char **)arena_push(ps->arena, &cmd->argv, &cmd->argc, sizeof(char *)) = ps->word;
+    cmd->expand |= ps->expand;
+}
+
+// NULL-terminate argv; without expansions the words lose their escapes
+void finish_words(Parser *ps, Command *cmd) {
+    *(char **)arena_push(ps->arena, &cmd->argv, &cmd->argc, sizeof(char *)) = NULL;
+    cmd->argc--;
+    if (!cmd->expand) {
+        for (int i = 0; i < cmd->argc; i++)
+            unescape_word(cmd->argv[i]);
+    }
+}
+
+// Keywords only count unquoted and where a command starts
+int is_keyword(Parser *ps, const char *word) {
+    return ps->tok == TOK_WORD && !ps->quoted && strcmp(ps->word, word) == 0;
+}
+
+// A keyword that closes a part of a compound command
+int ends_part(Parser *ps) {
+    static const char *words[] = { "then", "elif", "else", "fi", "do", "done", NULL };
+    for (int i = 0; words[i] != NULL; i++) {
+        if (is_keyword(ps, words[i]))
+            return 1;
+    }
+    return 0;
+}
+
+int expect_keyword(Parser *ps, const char *word) {
+    if (is_keyword(ps, word)) {
+        next_token(ps);
+        return 0;
+    }
+    if (ps->tok == TOK_END) {
+        char what[32];
+        snprintf(what, sizeof(what), "missing '%s'", word);
+        return need_more(ps, what);
+    }
+    return syntax_error(ps, NULL);
+}
+
+// Read the next token. Quotes and backslashes are taken out of words; in
+// a word with an expansion the $ and \ they protected stay escaped. A
+// backslash before a newline joins the lines.
+void next_token(Parser *ps) {
+    char *p = ps->p;
+    ps->prev_start = ps->start;
+    ps->prev_end = ps->end;
+    while (*p == ' ' || *p == '\t' || (*p == '\\' && p[1] == '\n'))
+        p += (*p == '\\') ? 2 : 1;
+    if (*p == '#')
+        p += strcspn(p, "\n"); // Comment
+    ps->start = p;
+    ps->word = NULL;
+    ps->expand = 0;
+    ps->quoted = 0;
+    if (*p == '\0') {
+        ps->tok = TOK_END;
+    } else if (*p == '\n') {
+        ps->tok = TOK_NEWLINE;
+        if (p == ps->line_end) {
+            p = ps->body_end; // Past the here-documents of the line
+            ps->line_end = NULL;
+        } else {
+            p++;
+        }
+    } else if (*p == '|' || *p == '&') {
+        int twice = (p[1] == p[0]);
+        ps->tok = *p == '|' ? (twice ? TOK_OR_IF : TOK_PIPE) : (twice ? TOK_AND_IF : TOK_AMP);
+        p += 1 + twice;
+    } else if (*p == ';') {
+        ps->tok = TOK_SEMI;
+        p++;
+    } else if (*p == '<' || *p == '>' || (isdigit((unsigned char)*p) && (p[1] == '<' || p[1] == '>'))) {
+        // A single digit right before the operator names the descriptor
+        ps->tok = TOK_REDIRECT;
+        ps->redir_fd = isdigit((unsigned char)*p) ? *p++ - '0' : (*p == '<' ? 0 : 1);
+        static const struct { const char *text; int op; } ops[] = {
+            { "<<<", REDIR_HERESTRING }, { "<<-", REDIR_HERETABS }, { "<<", REDIR_HEREDOC },
+            { "<&", REDIR_DUP }, { ">&", REDIR_DUP }, { ">>", REDIR_APPEND }, { ">|", REDIR_OUT },
+            { "<", REDIR_IN }, { ">", REDIR_OUT },
+        };
+        int i = 0;
+        while (strncmp(p, ops[i].text, strlen(ops[i].text)) != 0)
+            i++;
+        ps->redir_op = ops[i].op;
+        p += strlen(ops[i].text);
+    } else {
+        char *out = ps->buf;
+        char *open = NULL; // An unterminated quote
+        ps->tok = TOK_WORD;
+        while (*p != '\0' && strchr(" \t\n|&;<>", *p) == NULL) {
+            if (*p == '\'') {
+                char *close = strchr(p + 1, '\'');
+                if (close == NULL) {
+                    open = p;
+                    break;
+                }
+                for (p++; p < close; p++)
+                    out = escape_char(out, *p);
+                p++;
+                ps->quoted = 1;
+            } else if (*p == '"') {
+                // Inside double quotes $ still expands, and a backslash
+                // only quotes $, " and itself
+                open = p;
+                for (p++; *p != '"' && *p != '\0'; p++) {
+                    if (*p == '\\' && p[1] == '\n') {
+                        p++;
+                    } else if (*p == '\\' && p[1] != '\0' && strchr("$\"\\", p[1]) != NULL) {
+                        out = escape_char(out, *++p);
+                    } else if (*p == '$') {
+                        out = copy_expansion(ps, out, &p);
+                    } else {
+                        out = escape_char(out, *p);
+                    }
+                }
+                if (*p == '\0') {
+                    break;
+                }
+                open = NULL;
+                p++;
+                ps->quoted = 1;
+            } else if (*p == '\\' && p[1] == '\n') {
+                p += 2;
+            } else if (*p == '\\' && p[1] != '\0') {
+                out = escape_char(out, p[1]);
+                p += 2;
+                ps->quoted = 1;
+            } else if (*p == '\\') {
+                open = p; // A backslash at the very end continues the line
+                break;
+            } else if (*p == '$') {
+                out = copy_expansion(ps, out, &p);
+                p++;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (open != NULL) {
+            ps->tok = TOK_END;
+            ps->end = ps->p = p + strlen(p);
+            need_more(ps, *open == '\\' ? "unexpected end of input after '\\'" : "unterminated quote");
+            return;
+        }
+        ps->word = arena_strndup(ps->arena, ps->buf, out - ps->buf);
+    }
+    ps->end = ps->p = p;
+}
+
+// Copy the $ at *p, leaving *p on the last character used. $NAME is
+// written as ${NAME}, so that quote removal cannot join the name to
+// the characters after it.
+char *copy_expansion(Parser *ps, char *out, char **p) {
+    char *s = *p;
+    ps->expand = 1;
+    if (!is_name_char(s[1], 1)) {
+        *out++ = '$';
+        return out;
+    }
+    *out++ = '$';
+    *out++ = '{';
+    for (s++; is_name_char(*s, 0); s++)
+        *out++ = *s;
+    *out++ = '}';
+    *p = s - 1;
+    return out;
+}
+
+// A character from quotes or after a backslash, escaped if expand_word()
+// would otherwise read it as special
+char *escape_char(char *out, char c) {
+    if (c == '$' || c == '\\')
+        *out++ = '\\';
+    *out++ = c;
+    return out;
+}
+
+// Drop the escapes of a word that turned out to have no expansion
+void unescape_word(char *word) {
+    char *p = strchr(word, '\\');
+    if (p == NULL) {
+        return;
+    }
+    char *out = p;
+    for (; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        *out++ = *p;
+    }
+    *out = '\0';
+}
+
+// Record the first syntax error. With no description it is reported at
+// the current token, or at the operator before the end of the line.
+int syntax_error(Parser *ps, const char *what) {
+    if (ps->error == NULL) {
+        char msg[128];
+        char *at = ps->tok == TOK_END ? ps->prev_start : ps->start;
+        char *end = ps->tok == TOK_END ? ps->prev_end : ps->end;
+        if (what != NULL)
+            snprintf(msg, sizeof(msg), "Syntax error: %s", what);
+        else if (end == at)
+            snprintf(msg, sizeof(msg), "Syntax error: unexpected end of line");
+        else
+            snprintf(msg, sizeof(msg), "Syntax error near '%.*s'", (int)(end - at), at);
+        ps->error = arena_strdup(ps->arena, msg);
+    }
+    return -1;
+}
+
+// A syntax error that more input could fix, like an if without its fi
+int need_more(Parser *ps, const char *what) {
+    if (ps->error == NULL)
+        ps->incomplete = 1;
+    return syntax_error(ps, what);
+}
+
+// The history line for a command written over several lines. Newlines
+// become "; ", or a space where the command has to go on (after an
+// operator, or then, do...); comments and backslash-newlines are dropped.
+// Newlines inside quotes are kept, and here-documents need their lines, so
+// such a command is kept as it is; the history file escapes them.
+char *history_text(Arena *a, const char *text, size_t len) {
+    if (memchr(text, '\n', len) == NULL || memmem(text, len, "<<", 2) != NULL) {
+        return arena_strndup(a, text, len);
+    }
+    static const char *openers[] = { "if", "then", "elif", "else", "while", "until", "do", NULL };
+    char *out = arena_alloc(a, 2 * len + 1), *o = out;
+    const char *p = text, *end = text + len;
+    int command = 1, more = 1; // At a command word; the text so far cannot end here
+    while (p < end) {
+        if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+            p += 2;
+        } else if (*p == '\n') {
+            while (o > out && (o[-1] == ' ' || o[-1] == '\t'))
+                o--;
+            if (o > out && !more)
+                *o++ = ';';
+            if (o > out)
+                *o++ = ' ';
+            command = more = 1;
+            p++;
+        } else if (*p == ' ' || *p == '\t') {
+            *o++ = *p++;
+        } else if (*p == '#') {
+            p += strcspn(p, "\n"); // The text ends with a command, never in a comment
+        } else if (strchr(";&|<>", *p) != NULL) {
+            command = (*p != '<' && *p != '>');
+            more = 1;
+            *o++ = *p++;
+        } else {
+            char *word = o;
+            while (p < end && strchr(" \t\n;&|<>", *p) == NULL) {
+                if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+                    p += 2;
+                } else if (*p == '\\' && p + 1 < end) {
+                    *o++ = *p++;
+                    *o++ = *p++;
+                } else if (*p == '\'' || *p == '"') {
+                    char quote = *p;
+                    *o++ = *p++;
+                    while (p < end && *p != quote) {
+                        if (quote == '"' && *p == '\\' && p + 1 < end)
+                            *o++ = *p++;
+                        *o++ = *p++;
+                    }
+                    if (p < end)
+                        *o++ = *p++;
+                } else {
+                    *o++ = *p++;
+                }
+            }
+            int opener = 0;
+            for (int i = 0; command && openers[i] != NULL; i++) {
+                if ((size_t)(o - word) == strlen(openers[i]) && memcmp(word, openers[i], o - word) == 0)
+                    opener = 1;
+            }
+            command = more = opener;
+        }
+    }
+    while (o > out && (o[-1] == ' ' || o[-1] == '\t'))
+        o--;
+    *o = '\0';
+    return out;
+}
+
+// The compiled script at path, from the cache while the file's mtime and
+// size are unchanged. NULL, after reporting why, if it cannot be read.
+Script *load_script(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return NULL;
+    }
+    Script *s = scripts;
+    while (s != NULL && strcmp(s->path, path) != 0)
+        s = s->next;
+    if (s != NULL && (s->running || (s->mtime.tv_sec == st.st_mtim.tv_sec &&
+                                     s->mtime.tv_nsec == st.st_mtim.tv_nsec && s->size == st.st_size))) {
+        return s;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    size_t cap = st.st_size + 2, len = 0;
+    char *text = malloc(cap);
+    ssize_t n;
+    while ((n = read(fd, text + len, cap - len - 1)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror(path);
+            free(text);
+            close(fd);
+            return NULL;
+        }
+        len += n;
+        if (len + 1 == cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+    }
+    close(fd);
+
+    if (s == NULL) {
+        s = calloc(1, sizeof(Script));
+        s->path = strdup(path);
+        s->next = scripts;
+        scripts = s;
+    } else {
+        arena_reset(&s->arena);
+    }
+    s->mtime = st.st_mtim;
+    s->size = st.st_size;
+    compile_script(s, arena_strndup(&s->arena, text, len));
+    free(text);
+    return s;
+}
+
+// Compile text, which must live in s->arena, one command at a time. A
+// command can span lines; one with a syntax error is skipped up to the
+// end of the line where the error is.
+void compile_script(Script *s, char *text) {
+    Parser ps;
+    s->lines = NULL;
+    s->count = 0;
+    parser_init(&ps, &s->arena, text);
+    while (ps.tok != TOK_END) {
+        if (ps.tok == TOK_NEWLINE) {
+            next_token(&ps);
+            continue;
+        }
+        char *start = ps.start;
+        ScriptLine *line = arena_push(&s->arena, &s->lines, &s->count, sizeof(ScriptLine));
+        if (start[0] == '!' && (start == text || start[-1] == '\n')) {
+            ps.p = start + strcspn(start, "\n"); // A history reference
+            line->text = arena_strndup(&s->arena, start, ps.p - start);
+            next_token(&ps);
+            continue;
+        }
+        line->list = arena_alloc(&s->arena, sizeof(CommandList));
+        line->list->items = NULL;
+        line->list->count = 0;
+        if (parse_list(&ps, line->list, 0) < 0) {
+            line->list = NULL;
+            line->error = ps.error;
+            ps.error = NULL;
+            ps.p = ps.start + strcspn(ps.start, "\n");
+            if (ps.p != ps.line_end)
+                ps.line_end = NULL;
+            line->text = history_text(&s->arena, start, ps.p - start);
+            next_token(&ps);
+            continue;
+        }
+        // A command with here-documents ends after the last body
+        char *end = ps.prev_end;
+        if (ps.tok == TOK_NEWLINE && ps.end - ps.start > 1)
+            end = ps.end[-1] == '\n' ? ps.end - 1 : ps.end;
+        line->text = history_text(&s->arena, start, end - start);
+    }
+    free(ps.buf);
+}
+
+// Run every command of s. Commands go to history like typed ones, and
+// what one allocates in cmd_arena is released after it.
+void run_script(Script *s) {
+    Arena mark = cmd_arena;
+    s->running++;
+    last_status = 0;
+    for (int i = 0; i < s->count && !loop_jump && !interrupted; i++) {
+        ScriptLine *line = &s->lines[i];
+        long long t = timing ? now_ns() : 0;
+        if (line->list == NULL && line->error == NULL) {
+            repeat_command(arena_strdup(&cmd_arena, line->text));
+        } else if (line->list != NULL) {
+            add_to_history(line->text);
+            run_list(line->list);
+        } else {
+            add_to_history(line->text);
+            fprintf(stderr, "%s\n", line->error);
+            last_status = 2;
+        }
+        if (timing && source_depth == 0)
+            stats_add(&line_stats, now_ns() - t);
+        fflush(stdout); // Builtin output goes out before the next child writes
+        arena_rewind(&cmd_arena, &mark);
+        if (child_exited)
+            reap_children();
+    }
+    s->running--;
+}
+
+unsigned int hash_string(const char *s) {
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Resolve a command name to the file execve() should run, searching PATH
+// only the first time a name is seen. Returns NULL if it is not found.
+char *find_command(char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    unsigned int bucket = hash_string(name) % CMD_HASH_SIZE;
+    for (CmdHash *e = cmd_hash[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            hash_hits++;
+            return e->path;
+        }
+    }
+    hash_misses++;
+
+    char *pathvar = search_path();
+    size_t namelen = strlen(name);
+
+    // The completion index, if built for this PATH, knows the directory
+    if (comp_path != NULL && strcmp(comp_path, pathvar) == 0) {
+        long n;
+        CompName *c = lookup_names(comp_names, comp_count, name, &n);
+        if (n > 0 && strcmp(c->name, name) == 0 && c->dir >= 0) {
+            char *candidate = malloc(strlen(comp_dirs[c->dir].path) + namelen + 2);
+            sprintf(candidate, "%s/%s", comp_dirs[c->dir].path, name);
+            struct stat st;
+            if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+                return remember_command(name, candidate, bucket);
+            }
+            free(candidate); // Stale index: fall back to searching
+        }
+    }
+
+    char *dir = pathvar;
+    while (1) {
+        char *end = strchr(dir, ':');
+        size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+        char *candidate = malloc(dirlen + namelen + 3);
+        if (dirlen == 0) {
+            strcpy(candidate, "./"); // Empty PATH entry means the current directory
+        } else {
+            memcpy(candidate, dir, dirlen);
+            candidate[dirlen] = '/';
+            candidate[dirlen + 1] = '\0';
+        }
+        strcat(candidate, name);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return remember_command(name, candidate, bucket);
+        }
+        free(candidate);
+        if (end == NULL) {
+            break;
+        }
+        dir = end + 1;
+    }
+    return NULL;
+}
+
+char *remember_command(char *name, char *path, unsigned int bucket) {
+    CmdHash *e = malloc(sizeof(CmdHash));
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 1;
+    e->next = cmd_hash[bucket];
+    cmd_hash[bucket] = e;
+    return e->path;
+}
+
+char *search_path() {
+    char *pathvar = get_variable("PATH");
+    if (pathvar == NULL) {
+        pathvar = getenv("PATH");
+    }
+    return pathvar ? pathvar : "/usr/local/bin:/usr/bin:/bin";
+}
+
+void forget_command(char *name) {
+    CmdHash **link = &cmd_hash[hash_string(name) % CMD_HASH_SIZE];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            CmdHash *e = *link;
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+void clear_command_hash() {
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        while (cmd_hash[i] != NULL) {
+            CmdHash *e = cmd_hash[i];
+            cmd_hash[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+void hash_command(char *arglist[]) {
+    if (arglist[1] != NULL && strcmp(arglist[1], "-r") == 0) {
+        clear_command_hash();
+        return;
+    }
+    if (arglist[1] != NULL) {
+        for (int i = 1; arglist[i] != NULL; i++) {
+            if (strchr(arglist[i], '/') == NULL && find_command(arglist[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", arglist[i]);
+            }
+        }
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        for (CmdHash *e = cmd_hash[i]; e != NULL; e = e->next) {
+            printf("%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    printf("lookups: %ld hits, %ld misses\n", hash_hits, hash_misses);
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    while (a->cur == NULL || a->used + size > a->cur->size) {
+        if (a->cur != NULL && a->cur->next != NULL) {
+            // Chunks kept from earlier lines are reused before growing
+            a->cur = a->cur->next;
+            a->used = 0;
+            continue;
+        }
+        size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        ArenaChunk *c = malloc(sizeof(ArenaChunk) + chunk);
+        if (c == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        c->size = chunk;
+        c->next = NULL;
+        if (a->cur != NULL) {
+            a->cur->next = c;
+        } else {
+            a->first = c;
+        }
+        a->cur = c;
+        a->used = 0;
+    }
+    void *p = a->cur->data + a->used;
+    a->used += size;
+    return p;
+}
+
+char *arena_strdup(Arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t len) {
+    char *copy = arena_alloc(a, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Room for one more, zeroed, element of the array *base with *count
+// elements. Its capacity is the count rounded up to a power of two, so
+// it moves to a block twice the size whenever the count reaches one.
+void *arena_push(Arena *a, void *base, int *count, size_t size) {
+    char **array = base;
+    if ((*count & (*count - 1)) == 0) {
+        char *grown = arena_alloc(a, (*count ? *count * 2 : 1) * size);
+        if (*count > 0)
+            memcpy(grown, *array, *count * size);
+        *array = grown;
+    }
+    char *item = *array + (*count)++ * size;
+    memset(item, 0, size);
+    return item;
+}
+
+// Forget every allocation at once; the chunks stay for the next line
+void arena_reset(Arena *a) {
+    a->cur = a->first;
+    a->used = 0;
+}
+
+// Forget what was allocated since mark, a copy of *a taken earlier
+void arena_rewind(Arena *a, Arena *mark) {
+    if (mark->cur == NULL) {
+        arena_reset(a);
+        return;
+    }
+    a->cur = mark->cur;
+    a->used = mark->used;
+}
+
+// Return the next line without its newline, or NULL at end of input.
+// A final line with no newline is still returned.
+char *reader_getline(LineReader *r) {
+    size_t scanned = r->start;
+    while (1) {
+        // Nothing new to scan before the first read, when buf is still NULL
+        char *nl = r->end > scanned ? memchr(r->buf + scanned, '\n', r->end - scanned) : NULL;
+        if (nl != NULL) {
+            char *line = r->buf + r->start;
+            *nl = '\0';
+            r->start = nl - r->buf + 1;
+            return line;
+        }
+        scanned = r->end;
+        if (r->eof) {
+            if (r->start == r->end) {
+                return NULL;
+            }
+            char *line = r->buf + r->start;
+            r->buf[r->end] = '\0';
+            r->start = r->end;
+            return line;
+        }
+
+        // Make room: slide the partial line down, or grow for a long one
+        if (r->cap - r->end < READ_BUF_SIZE / 4 + 1 && r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            scanned -= r->start;
+            r->start = 0;
+        }
+        if (r->cap - r->end < READ_BUF_SIZE / 4 + 1) {
+            size_t cap = r->cap ? r->cap * 2 : READ_BUF_SIZE;
+            char *buf = realloc(r->buf, cap);
+            if (buf == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            r->buf = buf;
+            r->cap = cap;
+        }
+
+        if (wait_for_input(r->fd) < 0) {
+            perror("poll");
+        }
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1); // Keep room for the NUL
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            r->eof = 1;
+        } else if (n == 0) {
+            r->eof = 1;
+        } else {
+            r->end += n;
+        }
+    }
+}
+
+// Start again from the beginning of the input; -1 if it is not seekable
+int reader_rewind(LineReader *r) {
+    if (lseek(r->fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+    r->start = r->end = 0;
+    r->eof = 0;
+    return 0;
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_add(LatencyStats *st, long long ns) {
+    if (st->count == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 1024;
+        st->ns = realloc(st->ns, st->cap * sizeof(long long));
+    }
+    st->ns[st->count++] = ns;
+}
+
+int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile; sorts the samples in place
+long long stats_percentile(LatencyStats *st, double pct) {
+    if (st->count == 0) {
+        return 0;
+    }
+    qsort(st->ns, st->count, sizeof(long long), compare_ns);
+    long rank = (long)(pct / 100.0 * st->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > st->count) {
+        rank = st->count;
     }
+    return st->ns[rank - 1];
 }
 
-void free_variable(int index) {
-    free(variables[index].name);
-    free(variables[index].value);
-    variables[index].name = NULL;
-    variables[index].value = NULL;
+// -T summary, on stderr so it does not mix with the commands' output
+void report_line_stats(double seconds) {
+    fprintf(stderr, "%ld commands in %.3f s: %.0f commands/sec\n",
+            line_stats.count, seconds, seconds > 0 ? line_stats.count / seconds : 0.0);
+    fprintf(stderr, "latency p50 %.1f us, p99 %.1f us\n",
+            stats_percentile(&line_stats, 50) / 1e3, stats_percentile(&line_stats, 99) / 1e3);
 }
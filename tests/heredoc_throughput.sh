@@ -0,0 +1,39 @@
+#!/bin/sh
+# Write a large here-document body through `wc -c <<EOF` in shell6 and
+# check that every byte arrives, with and without $ expansion. Prints the
+# throughput.
+#
+# Usage: tests/heredoc_throughput.sh [MiB]    (shell6 is taken from $SHELL6)
+
+cd "$(dirname "$0")/.." || exit 1
+SHELL6=${SHELL6:-./shell6}
+MIB=${1:-64}
+[ -x "$SHELL6" ] || { echo "$SHELL6 not found; build it with gcc shell6.c -o shell6" >&2; exit 1; }
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# 64-byte lines, 16384 of them per MiB
+BYTES=$((MIB * 1048576))
+yes 'here-document body line, 64 bytes including its newline........' | head -n $((MIB * 16384)) > "$tmp/body"
+
+fail=0
+for delim in "'EOF'" EOF; do
+    { echo "wc -c <<$delim"; cat "$tmp/body"; echo EOF; } > "$tmp/script"
+    start=$(date +%s%N)
+    out=$("$SHELL6" "$tmp/script")
+    status=$?
+    end=$(date +%s%N)
+    if [ $status -ne 0 ]; then
+        echo "FAIL: <<$delim: shell6 exited with status $status"
+        fail=1
+    elif [ "$out" != "$BYTES" ]; then
+        echo "FAIL: <<$delim: wc counted '$out' bytes, expected $BYTES"
+        fail=1
+    else
+        ms=$(((end - start) / 1000000))
+        [ $ms -gt 0 ] || ms=1
+        echo "ok: <<$delim: $BYTES bytes in $ms ms ($((MIB * 1000 / ms)) MiB/s)"
+    fi
+done
+exit $fail
@@ -0,0 +1,86 @@
+#!/bin/sh
+# Benchmark the job table with thousands of background jobs alive at once:
+# start njobs long-running `sleep` jobs, then time `jobs`, `kill -CONT %n`
+# for every one of them (a job lookup that leaves it running) and reaping
+# them all once they are killed together. Fails if a job is missing, a
+# kill fails or anything is left behind.
+#
+# Usage: tests/jobs_bench.sh [njobs]    (shell6 is taken from $SHELL6)
+
+cd "$(dirname "$0")/.." || exit 1
+SHELL6=${SHELL6:-./shell6}
+N=${1:-10000}
+LONG=86399 # Seconds each job would sleep; also finds strays to clean up
+[ -x "$SHELL6" ] || { echo "$SHELL6 not found; build it with gcc shell6.c -o shell6" >&2; exit 1; }
+
+tmp=$(mktemp -d) || exit 1
+cleanup() {
+    for f in /proc/[0-9]*/cmdline; do
+        [ "$(tr '\0' ' ' < "$f" 2>/dev/null)" = "/bin/sleep $LONG " ] && kill -9 "$(basename "${f%/cmdline}")" 2>/dev/null
+    done
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# Each mark is written as "name nanoseconds"
+mark() {
+    echo "/bin/date \"+$1 %s%N\""
+}
+{
+    mark start
+    i=0
+    while [ $i -lt "$N" ]; do
+        echo "/bin/sleep $LONG &"
+        i=$((i + 1))
+    done
+    mark launched
+    echo "jobs > $tmp/jobs"
+    mark listed
+    i=1
+    while [ $i -le "$N" ]; do
+        echo "kill -CONT %$i"
+        i=$((i + 1))
+    done
+    mark signalled
+    # Every job is dead once this has slept; the shell reaps them all
+    # between it and the next line
+    echo "/bin/sh -c 'kill -9 \$(cut -d\" \" -f2 $tmp/jobs); /bin/sleep 1; /bin/date \"+killed %s%N\"'"
+    mark reaped
+    echo "jobs > $tmp/left"
+} > "$tmp/script"
+
+"$SHELL6" "$tmp/script" > "$tmp/out" 2> "$tmp/err"
+status=$?
+
+fail=0
+listed=$(wc -l < "$tmp/jobs")
+signalled=$(grep -c '^Sent Continued to job' "$tmp/out")
+left=$(wc -l < "$tmp/left")
+if [ $status -ne 0 ] || [ -s "$tmp/err" ]; then
+    echo "FAIL: shell6 exited with status $status"
+    head -5 "$tmp/err"
+    fail=1
+fi
+if [ "$listed" -ne "$N" ]; then
+    echo "FAIL: jobs listed $listed of $N jobs"
+    fail=1
+fi
+if [ "$signalled" -ne "$N" ]; then
+    echo "FAIL: kill %n found $signalled of $N jobs"
+    fail=1
+fi
+if [ "$left" -ne 0 ]; then
+    echo "FAIL: $left jobs left after all were killed"
+    fail=1
+fi
+[ $fail -eq 0 ] || exit 1
+
+grep -E '^(start|launched|listed|signalled|killed|reaped) ' "$tmp/out" | awk -v n="$N" '
+    { t[$1] = $2 }
+    END {
+        printf "ok: %d concurrent jobs\n", n
+        printf "  start    %8.1f ms (%.1f us/job)\n", (t["launched"] - t["start"]) / 1e6, (t["launched"] - t["start"]) / 1e3 / n
+        printf "  jobs     %8.1f ms\n", (t["listed"] - t["launched"]) / 1e6
+        printf "  kill %%n  %8.1f ms (%.1f us/job)\n", (t["signalled"] - t["listed"]) / 1e6, (t["signalled"] - t["listed"]) / 1e3 / n
+        printf "  reap     %8.1f ms (%.1f us/job)\n", (t["reaped"] - t["killed"]) / 1e6, (t["reaped"] - t["killed"]) / 1e3 / n
+    }'
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Start thousands of `&` jobs from one shell6 script and check that every
+# one ran, that `jobs` is empty once they have finished and that the shell
+# is left with no zombie children.
+#
+# Usage: tests/jobs_stress.sh [njobs]    (shell6 is taken from $SHELL6)
+
+cd "$(dirname "$0")/.." || exit 1
+SHELL6=${SHELL6:-./shell6}
+N=${1:-3000}
+[ -x "$SHELL6" ] || { echo "$SHELL6 not found; build it with gcc shell6.c -o shell6" >&2; exit 1; }
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+mkdir "$tmp/out"
+
+# Lists the shell's zombie children: its parent is the shell
+cat > "$tmp/zombies.sh" <<'ZOMBIES'
+for f in /proc/[0-9]*/stat; do
+    read -r s < "$f" 2>/dev/null || continue
+    set -- ${s##*) }
+    [ "$2" = "$PPID" ] && [ "$1" = Z ] && echo "zombie: ${f%/stat}"
+done
+exit 0
+ZOMBIES
+
+i=0
+while [ $i -lt "$N" ]; do
+    echo "/bin/touch $tmp/out/$i &"
+    i=$((i + 1))
+done > "$tmp/script"
+cat >> "$tmp/script" <<SCRIPT
+/bin/sleep 2
+jobs
+/bin/sh $tmp/zombies.sh
+SCRIPT
+
+out=$("$SHELL6" "$tmp/script" 2>&1)
+status=$?
+ran=$(ls "$tmp/out" | wc -l)
+
+fail=0
+if [ $status -ne 0 ]; then
+    echo "FAIL: shell6 exited with status $status"
+    fail=1
+fi
+if [ "$ran" -ne "$N" ]; then
+    echo "FAIL: $ran of $N jobs ran"
+    fail=1
+fi
+if [ -n "$out" ]; then
+    echo "FAIL: jobs or zombies left behind after all jobs finished:"
+    echo "$out" | head -20
+    fail=1
+fi
+[ $fail -eq 0 ] && echo "ok: $N background jobs, all reaped"
+exit $fail
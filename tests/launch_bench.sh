@@ -0,0 +1,29 @@
+#!/bin/sh
+# Compare the two launch paths as the shell's heap grows: commands/sec for
+# /bin/true with posix_spawn (default) and fork()+exec (-F), after -H has
+# made the shell's heap that many MiB.
+#
+# Usage: tests/launch_bench.sh [count] [MiB...]    (shell6 is taken from $SHELL6)
+
+cd "$(dirname "$0")/.." || exit 1
+SHELL6=${SHELL6:-./shell6}
+COUNT=${1:-300}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] || set -- 0 256 1024
+[ -x "$SHELL6" ] || { echo "$SHELL6 not found; build it with gcc shell6.c -o shell6" >&2; exit 1; }
+
+# -T prints "N commands in S s: R commands/sec" on stderr
+rate() {
+    "$SHELL6" "$@" -T -n "$COUNT" -c /bin/true 2>&1 >/dev/null | sed -n 's/.*: \([0-9]*\) commands\/sec/\1/p'
+}
+
+echo "heap MiB  posix_spawn cmd/s  fork+exec cmd/s"
+for mib in "$@"; do
+    spawn=$(rate -H "$mib")
+    fork=$(rate -F -H "$mib")
+    if [ -z "$spawn" ] || [ -z "$fork" ]; then
+        echo "FAIL: no -T report at $mib MiB"
+        exit 1
+    fi
+    printf "%8s  %17s  %15s\n" "$mib" "$spawn" "$fork"
+done
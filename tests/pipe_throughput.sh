@@ -0,0 +1,27 @@
+#!/bin/sh
+# Push GBs through `cat | tr | wc` in shell6 and check that every byte
+# arrives. Prints the throughput.
+#
+# Usage: tests/pipe_throughput.sh [bytes]    (shell6 is taken from $SHELL6)
+
+cd "$(dirname "$0")/.." || exit 1
+SHELL6=${SHELL6:-./shell6}
+BYTES=${1:-4294967296}
+[ -x "$SHELL6" ] || { echo "$SHELL6 not found; build it with gcc shell6.c -o shell6" >&2; exit 1; }
+
+start=$(date +%s%N)
+out=$("$SHELL6" -c "head -c $BYTES /dev/zero | cat | tr '\\0' a | wc -c")
+status=$?
+end=$(date +%s%N)
+
+if [ $status -ne 0 ]; then
+    echo "FAIL: shell6 exited with status $status"
+    exit 1
+fi
+if [ "$out" != "$BYTES" ]; then
+    echo "FAIL: wc counted '$out' bytes, expected $BYTES"
+    exit 1
+fi
+ms=$(((end - start) / 1000000))
+[ $ms -gt 0 ] || ms=1
+echo "ok: $BYTES bytes in $ms ms ($((BYTES / 1048576 * 1000 / ms)) MiB/s)"